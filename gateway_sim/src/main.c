@@ -0,0 +1,499 @@
+/* main.c - Simulated gateway for SHT41 peripheral fleets */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/types.h>
+#include <string.h>
+#include <errno.h>
+
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/uuid.h>
+#include <zephyr/bluetooth/gatt.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "uuids.h"
+
+LOG_MODULE_REGISTER(GATEWAY, LOG_LEVEL_INF);
+
+#define TX_HDR_SIZE				(2 * sizeof(uint32_t))
+#define RECORD_SIZE				8
+#define ACK_SIZE				(1 + sizeof(uint32_t))
+#define CONFIG_WRITE_SIZE		(2 + 2 * sizeof(uint16_t) + 2 + 2 * sizeof(uint16_t) + 1)
+
+// Offsets into the metrics read value of the peripheral
+#define METRICS_RETRIES			20
+#define METRICS_ACK_RTT			28
+#define METRICS_MIN_SIZE		30
+
+struct device_entry{
+	bt_addr_le_t addr;
+	int64_t served_at;		// uptime of the last connection, 0 never
+};
+
+struct link{
+	struct bt_conn *conn;
+	uint16_t index;			// device table entry
+	uint16_t rx_handle;
+	uint16_t tx_handle;
+	uint16_t metrics_handle;
+	struct bt_gatt_discover_params disc;
+	struct bt_gatt_discover_params ccc_disc;
+	struct bt_gatt_subscribe_params sub;
+	struct bt_gatt_write_params write;
+	struct bt_gatt_read_params read;
+	struct bt_gatt_exchange_params mtu;
+	uint8_t write_buf[CONFIG_WRITE_SIZE];
+	bool write_busy;
+	bool ack_pending;
+	bool seq_valid;
+	uint32_t next_seq;		// first sequence number not yet received
+	int64_t connected_at;
+	bool notified;
+	struct k_work_delayable hold_work;
+};
+
+static struct device_entry devices[CONFIG_GW_DEVICES_MAX];
+static size_t device_count;
+static struct link links[CONFIG_BT_MAX_CONN];
+static atomic_t connecting;
+
+static struct{
+	uint32_t connections;
+	uint32_t records;
+	uint32_t bytes;
+	uint32_t resent;
+	uint32_t first_notify_ms;	// sum over connections that received one
+	uint32_t first_notify_count;
+	uint32_t device_rtt_ms;		// sum of the means reported by the sensors
+	uint32_t device_rtt_count;
+	uint32_t device_retries;	// sum of the latest count of every sensor
+} stats;
+static struct k_spinlock stats_lock;
+static uint32_t device_retries[CONFIG_GW_DEVICES_MAX];
+
+static void scan_start(void);
+
+static struct link *link_get(struct bt_conn *conn)
+{
+	return &links[bt_conn_index(conn)];
+}
+
+static void write_done(struct bt_conn *conn, uint8_t err, struct bt_gatt_write_params *params);
+
+// Acknowledge everything received so far, coalesced while a write is pending
+static void send_ack(struct link *link)
+{
+	int res = 0;
+
+	if(link->write_busy){
+		link->ack_pending = true;
+		return;
+	}
+
+	link->ack_pending = false;
+	link->write_buf[0] = 0x00;
+	sys_put_le32(link->next_seq, &link->write_buf[1]);
+	link->write.handle = link->rx_handle;
+	link->write.offset = 0;
+	link->write.data = link->write_buf;
+	link->write.length = ACK_SIZE;
+	link->write.func = write_done;
+
+	link->write_busy = true;
+	res = bt_gatt_write(link->conn, &link->write);
+	if(res){
+		LOG_WRN("Ack write error %d", res);
+		link->write_busy = false;
+	}
+}
+
+static void write_done(struct bt_conn *conn, uint8_t err, struct bt_gatt_write_params *params)
+{
+	struct link *link = link_get(conn);
+
+	link->write_busy = false;
+	if(err){
+		LOG_WRN("Write error 0x%02x", err);
+	}
+
+	if(link->ack_pending){
+		send_ack(link);
+	}
+}
+
+#if CONFIG_GW_SAMPLE_INTERVAL_S
+// Give every sensor its own slot in the sample period and report every sample
+static void send_config(struct link *link)
+{
+	uint8_t *pos = link->write_buf;
+	int res = 0;
+
+	*pos++ = 0x18;
+	*pos++ = 2 * sizeof(uint16_t);
+	sys_put_le16(CONFIG_GW_SAMPLE_INTERVAL_S, pos);
+	sys_put_le16(link->index % CONFIG_GW_SAMPLE_INTERVAL_S, pos + 2);
+	pos += 4;
+	*pos++ = 0x14;
+	*pos++ = 2 * sizeof(uint16_t) + 1;
+	memset(pos, 0, 5);
+
+	link->write.handle = link->rx_handle;
+	link->write.offset = 0;
+	link->write.data = link->write_buf;
+	link->write.length = CONFIG_WRITE_SIZE;
+	link->write.func = write_done;
+
+	link->write_busy = true;
+	res = bt_gatt_write(link->conn, &link->write);
+	if(res){
+		LOG_WRN("Config write error %d", res);
+		link->write_busy = false;
+	}
+}
+#endif
+
+static uint8_t notify_cb(struct bt_conn *conn, struct bt_gatt_subscribe_params *params, const void *data, uint16_t length)
+{
+	struct link *link = link_get(conn);
+	uint32_t seq;
+	uint32_t count;
+	k_spinlock_key_t key;
+
+	if(!data){
+		return BT_GATT_ITER_STOP;
+	}
+
+	if(length < TX_HDR_SIZE){
+		return BT_GATT_ITER_CONTINUE;
+	}
+
+	seq = sys_get_le32(data);
+	count = (length - TX_HDR_SIZE) / RECORD_SIZE;
+
+	key = k_spin_lock(&stats_lock);
+	if(!link->notified){
+		link->notified = true;
+		stats.first_notify_ms += (uint32_t)(k_uptime_get() - link->connected_at);
+		stats.first_notify_count++;
+	}
+	// a sequence number from the past is a resend after a missed ack
+	if(link->seq_valid && (int32_t)(seq - link->next_seq) < 0){
+		stats.resent += MIN(count, link->next_seq - seq);
+	}
+	stats.records += count;
+	stats.bytes += length;
+	k_spin_unlock(&stats_lock, key);
+
+	link->next_seq = seq + count;
+	link->seq_valid = true;
+	send_ack(link);
+
+	return BT_GATT_ITER_CONTINUE;
+}
+
+static uint8_t discover_cb(struct bt_conn *conn, const struct bt_gatt_attr *attr, struct bt_gatt_discover_params *params)
+{
+	struct link *link = link_get(conn);
+	const struct bt_gatt_chrc *chrc;
+	int res = 0;
+
+	if(attr){
+		chrc = attr->user_data;
+		if(!bt_uuid_cmp(chrc->uuid, BT_UUID_DECLARE_128(RX_UUID))){
+			link->rx_handle = chrc->value_handle;
+		}
+		else if(!bt_uuid_cmp(chrc->uuid, BT_UUID_DECLARE_128(TX_UUID))){
+			link->tx_handle = chrc->value_handle;
+		}
+		else if(!bt_uuid_cmp(chrc->uuid, BT_UUID_DECLARE_128(METRICS_UUID))){
+			link->metrics_handle = chrc->value_handle;
+		}
+		return BT_GATT_ITER_CONTINUE;
+	}
+
+	if(!link->rx_handle || !link->tx_handle){
+		LOG_WRN("Not a sensor, disconnecting");
+		bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+		return BT_GATT_ITER_STOP;
+	}
+
+#if CONFIG_GW_SAMPLE_INTERVAL_S
+	send_config(link);
+#endif
+
+	link->sub.value_handle = link->tx_handle;
+	link->sub.ccc_handle = 0;
+	link->sub.end_handle = BT_ATT_LAST_ATTRIBUTE_HANDLE;
+	link->sub.disc_params = &link->ccc_disc;
+	link->sub.value = BT_GATT_CCC_NOTIFY;
+	link->sub.notify = notify_cb;
+	res = bt_gatt_subscribe(conn, &link->sub);
+	if(res){
+		LOG_WRN("Subscribe error %d", res);
+	}
+
+	return BT_GATT_ITER_STOP;
+}
+
+static uint8_t metrics_read_cb(struct bt_conn *conn, uint8_t err, struct bt_gatt_read_params *params, const void *data, uint16_t length)
+{
+	struct link *link = link_get(conn);
+	const uint8_t *value = data;
+	k_spinlock_key_t key;
+	uint32_t retries;
+
+	if(!err && data && length >= METRICS_MIN_SIZE){
+		retries = sys_get_le32(&value[METRICS_RETRIES]);
+		key = k_spin_lock(&stats_lock);
+		// counted since the sensor booted, replace the previous reading
+		stats.device_retries += retries - device_retries[link->index];
+		device_retries[link->index] = retries;
+		if(sys_get_le16(&value[METRICS_ACK_RTT])){
+			stats.device_rtt_ms += sys_get_le16(&value[METRICS_ACK_RTT]);
+			stats.device_rtt_count++;
+		}
+		k_spin_unlock(&stats_lock, key);
+	}
+
+	bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+	return BT_GATT_ITER_STOP;
+}
+
+// Time is up for this sensor, collect its metrics and make room for the next
+static void hold_work_handler(struct k_work *work)
+{
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	struct link *link = CONTAINER_OF(dwork, struct link, hold_work);
+	int res = -ENOENT;
+
+	if(!link->conn){
+		return;
+	}
+
+	if(link->metrics_handle){
+		link->read.func = metrics_read_cb;
+		link->read.handle_count = 1;
+		link->read.single.handle = link->metrics_handle;
+		link->read.single.offset = 0;
+		res = bt_gatt_read(link->conn, &link->read);
+	}
+
+	if(res){
+		bt_conn_disconnect(link->conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+	}
+}
+
+static void mtu_cb(struct bt_conn *conn, uint8_t err, struct bt_gatt_exchange_params *params)
+{
+	if(err){
+		LOG_WRN("MTU exchange error 0x%02x", err);
+	}
+}
+
+static void connected_cb(struct bt_conn *conn, uint8_t err)
+{
+	struct link *link = link_get(conn);
+	int res = 0;
+	k_spinlock_key_t key;
+
+	atomic_clear(&connecting);
+	if(err){
+		LOG_WRN("Connect error 0x%02x", err);
+		bt_conn_unref(link->conn);
+		link->conn = NULL;
+		scan_start();
+		return;
+	}
+
+	key = k_spin_lock(&stats_lock);
+	stats.connections++;
+	k_spin_unlock(&stats_lock, key);
+	link->connected_at = k_uptime_get();
+	link->notified = false;
+	link->seq_valid = false;
+	link->write_busy = false;
+	link->ack_pending = false;
+	link->rx_handle = 0;
+	link->tx_handle = 0;
+	link->metrics_handle = 0;
+
+	link->mtu.func = mtu_cb;
+	res = bt_gatt_exchange_mtu(conn, &link->mtu);
+	if(res){
+		LOG_WRN("MTU exchange error %d", res);
+	}
+
+	link->disc.uuid = NULL;
+	link->disc.func = discover_cb;
+	link->disc.start_handle = BT_ATT_FIRST_ATTRIBUTE_HANDLE;
+	link->disc.end_handle = BT_ATT_LAST_ATTRIBUTE_HANDLE;
+	link->disc.type = BT_GATT_DISCOVER_CHARACTERISTIC;
+	res = bt_gatt_discover(conn, &link->disc);
+	if(res){
+		LOG_WRN("Discover error %d", res);
+	}
+
+	k_work_reschedule(&link->hold_work, K_SECONDS(CONFIG_GW_HOLD_S));
+	scan_start();
+}
+
+static void disconnected_cb(struct bt_conn *conn, uint8_t reason)
+{
+	struct link *link = link_get(conn);
+
+	k_work_cancel_delayable(&link->hold_work);
+	if(link->conn){
+		bt_conn_unref(link->conn);
+		link->conn = NULL;
+	}
+
+	scan_start();
+}
+
+BT_CONN_CB_DEFINE(conn_callbacks) = {
+	.connected = connected_cb,
+	.disconnected = disconnected_cb,
+};
+
+// Table entry of a sensor, added when new, NULL when the table is full
+static struct device_entry *device_find(const bt_addr_le_t *addr)
+{
+	for(size_t i = 0; i < device_count; i++){
+		if(!bt_addr_le_cmp(&devices[i].addr, addr)){
+			return &devices[i];
+		}
+	}
+
+	if(device_count == ARRAY_SIZE(devices)){
+		return NULL;
+	}
+
+	bt_addr_le_copy(&devices[device_count].addr, addr);
+	devices[device_count].served_at = 0;
+	return &devices[device_count++];
+}
+
+static bool ad_has_service(struct bt_data *data, void *user_data)
+{
+	bool *found = user_data;
+	struct bt_uuid_128 uuid;
+
+	if(data->type != BT_DATA_UUID128_ALL && data->type != BT_DATA_UUID128_SOME){
+		return true;
+	}
+
+	for(size_t i = 0; i + BT_UUID_SIZE_128 <= data->data_len; i += BT_UUID_SIZE_128){
+		if(bt_uuid_create(&uuid.uuid, &data->data[i], BT_UUID_SIZE_128) &&
+			!bt_uuid_cmp(&uuid.uuid, BT_UUID_DECLARE_128(MAIN_SERVICE_UUID))){
+			*found = true;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void scan_cb(const bt_addr_le_t *addr, int8_t rssi, uint8_t type, struct net_buf_simple *ad)
+{
+	struct device_entry *entry;
+	struct link *link;
+	struct bt_conn *conn = NULL;
+	bool found = false;
+	int64_t now = k_uptime_get();
+	int res = 0;
+
+	if(type != BT_GAP_ADV_TYPE_ADV_IND || atomic_get(&connecting)){
+		return;
+	}
+
+	bt_data_parse(ad, ad_has_service, &found);
+	if(!found){
+		return;
+	}
+
+	entry = device_find(addr);
+	if(!entry || (entry->served_at && now - entry->served_at < CONFIG_GW_REVISIT_S * MSEC_PER_SEC)){
+		return;
+	}
+
+	if(bt_le_scan_stop()){
+		return;
+	}
+
+	atomic_set(&connecting, 1);
+	res = bt_conn_le_create(addr, BT_CONN_LE_CREATE_CONN, BT_LE_CONN_PARAM_DEFAULT, &conn);
+	if(res){
+		LOG_WRN("Create connection error %d", res);
+		atomic_clear(&connecting);
+		scan_start();
+		return;
+	}
+
+	entry->served_at = now;
+	link = link_get(conn);
+	link->conn = conn;
+	link->index = (uint16_t)(entry - devices);
+}
+
+static void scan_start(void)
+{
+	int res = 0;
+	size_t idle = 0;
+
+	for(size_t i = 0; i < ARRAY_SIZE(links); i++){
+		if(!links[i].conn){
+			idle++;
+		}
+	}
+
+	if(!idle || atomic_get(&connecting)){
+		return;
+	}
+
+	res = bt_le_scan_start(BT_LE_SCAN_PASSIVE, scan_cb);
+	if(res && res != -EALREADY){
+		LOG_WRN("Scan start error %d", res);
+	}
+}
+
+static void report(int64_t start)
+{
+	uint32_t elapsed_s = (uint32_t)((k_uptime_get() - start) / MSEC_PER_SEC);
+	k_spinlock_key_t key = k_spin_lock(&stats_lock);
+
+	LOG_INF("%u s: %u sensors, %u connections, %u records, %u bytes, %u records/s", elapsed_s, device_count,
+		stats.connections, stats.records, stats.bytes, elapsed_s ? stats.records / elapsed_s : 0);
+	LOG_INF("first notify %u ms, %u records resent, sensor ack rtt %u ms, %u sensor retries",
+		stats.first_notify_count ? stats.first_notify_ms / stats.first_notify_count : 0, stats.resent,
+		stats.device_rtt_count ? stats.device_rtt_ms / stats.device_rtt_count : 0, stats.device_retries);
+	k_spin_unlock(&stats_lock, key);
+}
+
+void main(void)
+{
+	int res = 0;
+	int64_t start;
+
+	for(size_t i = 0; i < ARRAY_SIZE(links); i++){
+		k_work_init_delayable(&links[i].hold_work, hold_work_handler);
+	}
+
+	res = bt_enable(NULL);
+	if(res){
+		LOG_ERR("Bluetooth enable error %d", res);
+		return;
+	}
+
+	start = k_uptime_get();
+	scan_start();
+
+	while(1){
+		k_sleep(K_SECONDS(CONFIG_GW_REPORT_S));
+		report(start);
+	}
+}
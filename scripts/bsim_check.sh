@@ -0,0 +1,85 @@
+#!/usr/bin/env bash
+# SPDX-License-Identifier: Apache-2.0
+#
+# Pass/fail check of the application against the simulated gateway in
+# BabbleSim, exits non-zero on failure.
+#
+# Usage: bsim_check.sh [sensors] [seconds]
+#
+# Two simulations are run with bsim_fleet.sh:
+#  - the benchmark build (BENCH) alone with the gateway, which must print
+#    "bench done" with 0 errors in every stage
+#  - a fleet of regular builds (PERIPHERAL), where the gateway must
+#    receive at least MIN_RECORDS_S records/s and resend at most
+#    MAX_RESENT_PERMILLE of them
+#
+# BENCH, PERIPHERAL and GATEWAY point at the nrf52_bsim zephyr.exe images,
+# BSIM_OUT_PATH at the BabbleSim install. Logs go to LOG_DIR.
+
+set -eu
+
+SENSORS=${1:-20}
+SECONDS_SIM=${2:-300}
+BENCH=$(realpath "${BENCH:-build_bench/zephyr/zephyr.exe}")
+PERIPHERAL=$(realpath "${PERIPHERAL:-build/zephyr/zephyr.exe}")
+GATEWAY=$(realpath "${GATEWAY:-gateway_sim/build_gw/zephyr/zephyr.exe}")
+LOG_DIR=$(realpath -m "${LOG_DIR:-bsim_logs}")
+# sensors sample every 10 s, expect at least half of it end to end
+MIN_RECORDS_S=${MIN_RECORDS_S:-$(( SENSORS / 20 > 0 ? SENSORS / 20 : 1 ))}
+MAX_RESENT_PERMILLE=${MAX_RESENT_PERMILLE:-10}
+BENCH_SECONDS=${BENCH_SECONDS:-60}
+
+FLEET=$(dirname "$(realpath "$0")")/bsim_fleet.sh
+failed=0
+
+mkdir -p "$LOG_DIR/bench" "$LOG_DIR/fleet"
+
+fail()
+{
+	echo "FAIL: $*"
+	failed=1
+}
+
+echo "bench: 1 sensor, $BENCH_SECONDS s"
+PERIPHERAL=$BENCH GATEWAY=$GATEWAY LOG_DIR=$LOG_DIR/bench SIM_ID=sht41_check_bench \
+	"$FLEET" 1 "$BENCH_SECONDS" > "$LOG_DIR/bench/gateway.log" 2>&1 || true
+
+# lines carry the bsim device and time prefix
+bench_log=$LOG_DIR/bench/sensor_1.log
+grep -h "bench " "$bench_log" || true
+if ! grep -q "bench done" "$bench_log"; then
+	fail "bench did not finish"
+fi
+if grep "bench .* errors" "$bench_log" | grep -vq ", 0 errors"; then
+	fail "bench reported errors"
+fi
+
+echo "fleet: $SENSORS sensors, $SECONDS_SIM s"
+PERIPHERAL=$PERIPHERAL GATEWAY=$GATEWAY LOG_DIR=$LOG_DIR/fleet SIM_ID=sht41_check_fleet \
+	"$FLEET" "$SENSORS" "$SECONDS_SIM" > "$LOG_DIR/fleet/gateway.log" 2>&1 || true
+
+# the last summary covers the whole run
+summary=$(grep " records/s" "$LOG_DIR/fleet/gateway.log" | tail -n 1 || true)
+resend=$(grep " records resent" "$LOG_DIR/fleet/gateway.log" | tail -n 1 || true)
+if [ -z "$summary" ] || [ -z "$resend" ]; then
+	fail "no gateway summary"
+else
+	echo "$summary"
+	echo "$resend"
+	records=$(echo "$summary" | sed -n 's/.* \([0-9]*\) records, .*/\1/p')
+	rate=$(echo "$summary" | sed -n 's/.* \([0-9]*\) records\/s.*/\1/p')
+	resent=$(echo "$resend" | sed -n 's/.* \([0-9]*\) records resent.*/\1/p')
+
+	if [ "${rate:-0}" -lt "$MIN_RECORDS_S" ]; then
+		fail "$rate records/s, expected at least $MIN_RECORDS_S"
+	fi
+	if [ $(( ${resent:-0} * 1000 )) -gt $(( ${records:-0} * MAX_RESENT_PERMILLE )) ]; then
+		fail "$resent of $records records resent, at most $MAX_RESENT_PERMILLE permille allowed"
+	fi
+fi
+
+if [ "$failed" -ne 0 ]; then
+	exit 1
+fi
+
+echo "PASS"
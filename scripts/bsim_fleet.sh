@@ -0,0 +1,34 @@
+#!/usr/bin/env bash
+# SPDX-License-Identifier: Apache-2.0
+#
+# Run a fleet of simulated sensors and the simulated gateway in BabbleSim.
+#
+# Usage: bsim_fleet.sh [sensors] [seconds]
+#
+# PERIPHERAL and GATEWAY point at the nrf52_bsim zephyr.exe of the
+# application and of gateway_sim, BSIM_OUT_PATH at the BabbleSim install.
+# Only the gateway output is shown, sensor output goes to LOG_DIR.
+
+set -eu
+
+SENSORS=${1:-100}
+SECONDS_SIM=${2:-600}
+PERIPHERAL=$(realpath "${PERIPHERAL:-build/zephyr/zephyr.exe}")
+GATEWAY=$(realpath "${GATEWAY:-gateway_sim/build_gw/zephyr/zephyr.exe}")
+LOG_DIR=$(realpath -m "${LOG_DIR:-bsim_logs}")
+SIM_ID=${SIM_ID:-sht41_fleet}
+
+: "${BSIM_OUT_PATH:?set BSIM_OUT_PATH to the BabbleSim install}"
+
+mkdir -p "$LOG_DIR"
+cd "$BSIM_OUT_PATH/bin"
+
+./bs_2G4_phy_v1 -s="$SIM_ID" -D=$((SENSORS + 1)) -sim_length=$((SECONDS_SIM * 1000000)) > "$LOG_DIR/phy.log" &
+
+for i in $(seq 1 "$SENSORS"); do
+	# the random seed gives every sensor its own address
+	"$PERIPHERAL" -s="$SIM_ID" -d="$i" -rs="$i" > "$LOG_DIR/sensor_$i.log" 2>&1 &
+done
+
+"$GATEWAY" -s="$SIM_ID" -d=0 -rs=0
+wait
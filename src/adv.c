@@ -0,0 +1,255 @@
+/* adv.c - Advertising scheduler */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/hci.h>
+#include <zephyr/bluetooth/hci_vs.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+
+#include "adv.h"
+#include "metrics.h"
+#include "uuids.h"
+
+LOG_MODULE_REGISTER(ADV, CONFIG_APP_ADV_LOG_LEVEL);
+
+#define ADV_RETRY_MS		500
+
+// Manufacturer data: company ID, uint16 sequence, int16 centi-degrees C, uint16 centi-percent RH
+#define MFG_DATA_SIZE		8
+
+enum adv_phase{
+	ADV_PHASE_OFF,
+	ADV_PHASE_FAST,
+	ADV_PHASE_SLOW
+};
+
+// One time: the advertiser stops on connect instead of resuming on its own, adv_restart() decides what follows
+#define ADV_OPT				(BT_LE_ADV_OPT_CONNECTABLE | BT_LE_ADV_OPT_ONE_TIME | BT_LE_ADV_OPT_USE_NAME)
+
+static const struct bt_le_adv_param fast_param = BT_LE_ADV_PARAM_INIT(ADV_OPT,
+	CONFIG_APP_ADV_FAST_INTERVAL_MIN, CONFIG_APP_ADV_FAST_INTERVAL_MAX, NULL);
+#if defined(CONFIG_APP_ADV_ACCEPT_LIST)
+static const struct bt_le_adv_param bonded_param = BT_LE_ADV_PARAM_INIT(ADV_OPT | BT_LE_ADV_OPT_FILTER_CONN | BT_LE_ADV_OPT_FILTER_SCAN_REQ, CONFIG_APP_ADV_FAST_INTERVAL_MIN, CONFIG_APP_ADV_FAST_INTERVAL_MAX, NULL);
+#endif
+static const struct bt_le_adv_param slow_param = BT_LE_ADV_PARAM_INIT(ADV_OPT,
+	CONFIG_APP_ADV_SLOW_INTERVAL_MIN, CONFIG_APP_ADV_SLOW_INTERVAL_MAX, NULL);
+
+#if defined(CONFIG_APP_BROADCAST)
+static uint8_t mfg_data[MFG_DATA_SIZE] = {
+	(CONFIG_APP_BROADCAST_COMPANY_ID & 0xff), (CONFIG_APP_BROADCAST_COMPANY_ID >> 8)
+};
+static uint16_t broadcast_seq;
+#endif
+
+static const struct bt_data adv_data [] = {
+	BT_DATA_BYTES(BT_DATA_FLAGS, BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR),
+	BT_DATA_BYTES(BT_DATA_UUID128_ALL, MAIN_SERVICE_UUID),
+#if defined(CONFIG_APP_BROADCAST)
+	BT_DATA(BT_DATA_MANUFACTURER_DATA, mfg_data, sizeof(mfg_data)),
+#endif
+};
+
+// Advertiser state, guarded by adv_lock
+static enum adv_phase phase;
+// adv_restart() was called, the next work run starts over with fast advertising
+static atomic_t restart_req;
+static struct k_work_delayable adv_work;
+// Serialises advertising starts and data updates
+K_MUTEX_DEFINE(adv_lock);
+
+#if defined(CONFIG_APP_ADV_TX_POWER)
+static void set_tx_power(int8_t dbm)
+{
+	int ret = 0;
+	struct bt_hci_cp_vs_write_tx_power_level *cp;
+	struct bt_hci_rp_vs_write_tx_power_level *rp;
+	struct net_buf *buf;
+	struct net_buf *rsp = NULL;
+
+	buf = bt_hci_cmd_create(BT_HCI_OP_VS_WRITE_TX_POWER_LEVEL, sizeof(*cp));
+	if(!buf){
+		LOG_WRN("No buffer for TX power command");
+		return;
+	}
+
+	cp = net_buf_add(buf, sizeof(*cp));
+	// legacy advertising always uses set 0
+	cp->handle = sys_cpu_to_le16(0);
+	cp->handle_type = BT_HCI_VS_LL_HANDLE_TYPE_ADV;
+	cp->tx_power_level = dbm;
+
+	ret = bt_hci_cmd_send_sync(BT_HCI_OP_VS_WRITE_TX_POWER_LEVEL, buf, &rsp);
+	if(ret){
+		LOG_WRN("Set TX power error %d", ret);
+		return;
+	}
+
+	rp = (void *)rsp->data;
+	LOG_DBG("Advertising TX power %d dBm", rp->selected_tx_power);
+	net_buf_unref(rsp);
+}
+#endif
+
+#if defined(CONFIG_APP_ADV_ACCEPT_LIST)
+static void accept_bond(const struct bt_bond_info *info, void *user_data)
+{
+	int ret = 0;
+	int *count = user_data;
+
+	ret = bt_le_filter_accept_list_add(&info->addr);
+	if(ret){
+		LOG_WRN("Accept list add error %d", ret);
+		return;
+	}
+
+	(*count)++;
+}
+
+// Put the bonded peers in the accept list, returns how many were added
+static int load_accept_list(void)
+{
+	int ret = 0;
+	int count = 0;
+
+	// only changes while not advertising
+	ret = bt_le_filter_accept_list_clear();
+	if(ret){
+		LOG_WRN("Accept list clear error %d", ret);
+		return 0;
+	}
+
+	bt_foreach_bond(BT_ID_DEFAULT, accept_bond, &count);
+	return count;
+}
+#endif
+
+static int start_phase(enum adv_phase next)
+{
+	int ret = 0;
+	const struct bt_le_adv_param *param = (next == ADV_PHASE_FAST) ? &fast_param : &slow_param;
+
+	k_mutex_lock(&adv_lock, K_FOREVER);
+
+	// unconditionally, a no-op when idle, so the accept list can change and the start cannot hit -EALREADY
+	bt_le_adv_stop();
+	phase = ADV_PHASE_OFF;
+
+#if defined(CONFIG_APP_ADV_ACCEPT_LIST)
+	if(next == ADV_PHASE_FAST && load_accept_list()){
+		LOG_DBG("Fast advertising to bonded peers");
+		param = &bonded_param;
+	}
+#endif
+
+	ret = bt_le_adv_start(param, adv_data, ARRAY_SIZE(adv_data), NULL, 0);
+	if(ret){
+		k_mutex_unlock(&adv_lock);
+		return ret;
+	}
+
+	phase = next;
+	k_mutex_unlock(&adv_lock);
+
+#if defined(CONFIG_APP_ADV_TX_POWER)
+	set_tx_power((next == ADV_PHASE_FAST) ? CONFIG_APP_ADV_FAST_TX_POWER_DBM : CONFIG_APP_ADV_SLOW_TX_POWER_DBM);
+#endif
+
+	LOG_DBG("%s advertising started", (next == ADV_PHASE_FAST) ? "Fast" : "Slow");
+	return 0;
+}
+
+static enum adv_phase get_phase(void)
+{
+	enum adv_phase current;
+
+	k_mutex_lock(&adv_lock, K_FOREVER);
+	current = phase;
+	k_mutex_unlock(&adv_lock);
+
+	return current;
+}
+
+static void adv_work_handler(struct k_work *work)
+{
+	int ret = 0;
+
+	if(!atomic_clear(&restart_req) && get_phase() == ADV_PHASE_FAST){
+		// fast window over, back off
+		ret = start_phase(ADV_PHASE_SLOW);
+	}
+	else{
+		ret = adv_start();
+	}
+
+	if(ret){
+		// e.g. the connection object is not released yet
+		METRIC_WRN(METRIC_ADV_ERROR, "Advertising start error %d, retrying", ret);
+		k_work_reschedule(&adv_work, K_MSEC(ADV_RETRY_MS));
+	}
+}
+
+int adv_init(void)
+{
+	k_work_init_delayable(&adv_work, adv_work_handler);
+	return 0;
+}
+
+int adv_start(void)
+{
+	int ret = 0;
+
+	ret = start_phase(ADV_PHASE_FAST);
+	if(ret){
+		return ret;
+	}
+
+	k_work_reschedule(&adv_work, K_SECONDS(CONFIG_APP_ADV_FAST_WINDOW_S));
+	return 0;
+}
+
+void adv_restart(void)
+{
+	atomic_set(&restart_req, 1);
+	k_work_reschedule(&adv_work, K_NO_WAIT);
+}
+
+void adv_connected(void)
+{
+	k_work_cancel_delayable(&adv_work);
+	atomic_clear(&restart_req);
+
+	// one time advertising stopped with the connection
+	k_mutex_lock(&adv_lock, K_FOREVER);
+	phase = ADV_PHASE_OFF;
+	k_mutex_unlock(&adv_lock);
+}
+
+#if defined(CONFIG_APP_BROADCAST)
+void adv_update_reading(const struct sample_record *rec)
+{
+	int ret = 0;
+
+	k_mutex_lock(&adv_lock, K_FOREVER);
+
+	broadcast_seq++;
+	sys_put_le16(broadcast_seq, &mfg_data[2]);
+	sys_put_le16((uint16_t)rec->temp, &mfg_data[4]);
+	sys_put_le16(rec->rh, &mfg_data[6]);
+
+	// while connected the new data is picked up by the next advertising start
+	if(phase != ADV_PHASE_OFF){
+		ret = bt_le_adv_update_data(adv_data, ARRAY_SIZE(adv_data), NULL, 0);
+		if(ret){
+			METRIC_WRN(METRIC_ADV_ERROR, "Advertising data update error %d", ret);
+		}
+	}
+
+	k_mutex_unlock(&adv_lock);
+}
+#endif
@@ -0,0 +1,41 @@
+/* adv.h - Advertising scheduler */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef ADV_H_
+#define ADV_H_
+
+#include "sample.h"
+
+/*
+ * Advertising runs at a fast interval for CONFIG_APP_ADV_FAST_WINDOW_S after
+ * boot or a disconnect, then backs off to a slow interval and optionally a
+ * lower TX power until a central connects. With CONFIG_APP_ADV_ACCEPT_LIST
+ * only bonded centrals are answered in the fast phase.
+ */
+
+int adv_init(void);
+
+// Start fast advertising now
+int adv_start(void);
+
+// Restart fast advertising from the system work queue, e.g. after a disconnect
+void adv_restart(void);
+
+// Advertising stopped because a central connected
+void adv_connected(void);
+
+/*
+ * With CONFIG_APP_BROADCAST the latest reading and a sequence counter are
+ * carried in manufacturer specific advertising data so scanners can collect
+ * readings without connecting.
+ */
+#if defined(CONFIG_APP_BROADCAST)
+void adv_update_reading(const struct sample_record *rec);
+#else
+static inline void adv_update_reading(const struct sample_record *rec) {}
+#endif
+
+#endif /* ADV_H_ */
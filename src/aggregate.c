@@ -0,0 +1,129 @@
+/* aggregate.c - Incremental min/max/mean aggregation of samples */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aggregate.h"
+#include "report_filter.h"
+
+LOG_MODULE_REGISTER(AGGREGATE, CONFIG_APP_AGGREGATE_LOG_LEVEL);
+
+static struct{
+	uint16_t count;
+	uint32_t start;		// timestamp of the first sample
+	int32_t temp_sum;
+	uint32_t rh_sum;
+	struct sample_record temp_min;
+	struct sample_record temp_max;
+	struct sample_record rh_min;
+	struct sample_record rh_max;
+} window;
+
+void aggregate_add(const struct sample_record *rec)
+{
+	if(!window.count){
+		window.start = rec->timestamp;
+		window.temp_min = *rec;
+		window.temp_max = *rec;
+		window.rh_min = *rec;
+		window.rh_max = *rec;
+	}
+	else{
+		if(rec->temp < window.temp_min.temp){
+			window.temp_min = *rec;
+		}
+		if(rec->temp > window.temp_max.temp){
+			window.temp_max = *rec;
+		}
+		if(rec->rh < window.rh_min.rh){
+			window.rh_min = *rec;
+		}
+		if(rec->rh > window.rh_max.rh){
+			window.rh_max = *rec;
+		}
+	}
+
+	window.count++;
+	window.temp_sum += rec->temp;
+	window.rh_sum += rec->rh;
+
+	// keep the sums in range, the window simply closes early
+	if(window.count == UINT16_MAX){
+		LOG_WRN("Aggregation window full");
+	}
+}
+
+uint16_t aggregate_count(void)
+{
+	return window.count;
+}
+
+static void add_extreme(struct sample_record *out, size_t *n, const struct sample_record *rec, const struct sample_record *mean)
+{
+	// the deadband set by the client, 0 reports every extreme
+	if(report_filter_within(rec, mean)){
+		return;
+	}
+
+	// one sample can hold several extremes, out[0] is the window record
+	for(size_t i = 1; i < *n; i++){
+		if(out[i].timestamp == rec->timestamp){
+			return;
+		}
+	}
+
+	out[*n] = *rec;
+	sample_set_kind(&out[*n], SAMPLE_KIND_EXTREME);
+	(*n)++;
+}
+
+size_t aggregate_finish(uint32_t timestamp, struct sample_record *out)
+{
+	struct sample_record mean;
+	struct sample_record tmp;
+	size_t n = 1;
+
+	if(!window.count){
+		return 0;
+	}
+
+	out[0].timestamp = window.start;
+	out[0].temp = (int16_t)window.count;
+	out[0].rh = 0;
+	sample_set_kind(&out[0], SAMPLE_KIND_WINDOW);
+
+	mean.timestamp = timestamp;
+	mean.temp = (int16_t)(window.temp_sum / window.count);
+	mean.rh = (uint16_t)(window.rh_sum / window.count);
+
+	add_extreme(out, &n, &window.temp_min, &mean);
+	add_extreme(out, &n, &window.temp_max, &mean);
+	add_extreme(out, &n, &window.rh_min, &mean);
+	add_extreme(out, &n, &window.rh_max, &mean);
+
+	// order the extremes by time, the mean closes the window
+	for(size_t i = 2; i < n; i++){
+		tmp = out[i];
+		size_t j = i;
+		while(j > 1 && out[j - 1].timestamp > tmp.timestamp){
+			out[j] = out[j - 1];
+			j--;
+		}
+		out[j] = tmp;
+	}
+
+	sample_set_kind(&mean, SAMPLE_KIND_MEAN);
+	out[n++] = mean;
+
+	LOG_DBG("Window of %u samples, temp %d..%d, rh %u..%u", window.count, window.temp_min.temp,
+		window.temp_max.temp, window.rh_min.rh, window.rh_max.rh);
+
+	memset(&window, 0, sizeof(window));
+	return n;
+}
@@ -0,0 +1,42 @@
+/* aggregate.h - Incremental min/max/mean aggregation of samples */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef AGGREGATE_H_
+#define AGGREGATE_H_
+
+#include <stddef.h>
+#include <zephyr/types.h>
+
+#include "sample.h"
+
+/*
+ * Samples taken every CONFIG_APP_AGGREGATE_SAMPLE_S are folded into a window
+ * in O(1) memory. When the window closes it is summarised in sample records
+ * marked with their kind (see sample.h) so the transmit, backfill and log
+ * paths stay unchanged: a window record with the start time and sample count,
+ * the samples holding the temperature and humidity extremes, stamped with the
+ * time they were seen, when they differ from the mean by more than the current
+ * report deadband, and the mean, stamped with the window end.
+ */
+
+// Upper bound of records produced per window: window record, four extremes and the mean
+#define AGGREGATE_MAX_RECORDS		6
+// Records of a window without extremes
+#define AGGREGATE_MIN_RECORDS		2
+
+void aggregate_add(const struct sample_record *rec);
+
+// Number of samples in the open window
+uint16_t aggregate_count(void);
+
+/*
+ * Close the window and write its summary, oldest first, into out. Returns the
+ * number of records written, 0 if the window was empty. The mean is the last
+ * record.
+ */
+size_t aggregate_finish(uint32_t timestamp, struct sample_record *out);
+
+#endif /* AGGREGATE_H_ */
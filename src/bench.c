@@ -0,0 +1,137 @@
+/* bench.c - Hot path latency benchmark */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/printk.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "encode.h"
+#include "sample.h"
+#include "sht41.h"
+
+// Records packed per iteration, a full notification at the default MTU
+#define BENCH_RECORDS				28
+#define BENCH_HDR_SIZE				(2 * sizeof(uint32_t))
+// A notification not sent by then counts as a send error
+#define BENCH_SENT_TIMEOUT_MS		1000
+
+enum bench_stage{
+	BENCH_FETCH,
+	BENCH_PACK,
+	BENCH_DELTA,
+	BENCH_SEND,
+	BENCH_STAGE_COUNT
+};
+
+static const char *const stage_names[] = {
+	[BENCH_FETCH] = "fetch",
+	[BENCH_PACK] = "pack",
+	[BENCH_DELTA] = "delta",
+	[BENCH_SEND] = "send"
+};
+
+static uint32_t cycles[BENCH_STAGE_COUNT][CONFIG_APP_BENCH_ITERATIONS];
+static struct sample_record recs[BENCH_RECORDS];
+static uint8_t buf[BENCH_HDR_SIZE + BENCH_RECORDS * sizeof(struct sample_record)];
+static K_SEM_DEFINE(subscribed_sem, 0, 1);
+static K_SEM_DEFINE(sent_sem, 0, 1);
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void print_stage(enum bench_stage stage, int errors)
+{
+	uint32_t *c = cycles[stage];
+	size_t n = CONFIG_APP_BENCH_ITERATIONS;
+
+	qsort(c, n, sizeof(c[0]), cmp_u32);
+	printk("bench %-6s p50 %u p90 %u p99 %u max %u cycles, p99 %u us, %d errors\n", stage_names[stage],
+		c[n / 2], c[n * 9 / 10], c[n * 99 / 100], c[n - 1], k_cyc_to_us_ceil32(c[n * 99 / 100]), errors);
+}
+
+static void print_stack(const struct k_thread *thread, void *user_data)
+{
+	size_t unused = 0;
+	const char *name = k_thread_name_get((k_tid_t)thread);
+
+	if(k_thread_stack_space_get(thread, &unused)){
+		return;
+	}
+
+	printk("bench stack %-12s size %u unused %u\n", name ? name : "?", thread->stack_info.size, unused);
+}
+
+void bench_subscribed(void)
+{
+	k_sem_give(&subscribed_sem);
+}
+
+void bench_sent(void)
+{
+	k_sem_give(&sent_sem);
+}
+
+void bench_run(bench_send_fn send)
+{
+	int ret = 0;
+	int errors[BENCH_STAGE_COUNT] = {0};
+	struct sht41_data data = {0};
+	uint32_t start;
+	size_t len;
+
+	printk("bench waiting for a subscriber\n");
+	k_sem_take(&subscribed_sem, K_FOREVER);
+	printk("bench start, %u iterations\n", CONFIG_APP_BENCH_ITERATIONS);
+
+	for(size_t i = 0; i < CONFIG_APP_BENCH_ITERATIONS; i++){
+		start = k_cycle_get_32();
+		if(sht41_fetch_data(&data)){
+			errors[BENCH_FETCH]++;
+		}
+		cycles[BENCH_FETCH][i] = k_cycle_get_32() - start;
+
+		// slide the reading into the batch like the ring buffer does
+		memmove(&recs[0], &recs[1], sizeof(recs) - sizeof(recs[0]));
+		recs[BENCH_RECORDS - 1].timestamp = i;
+		recs[BENCH_RECORDS - 1].temp = data.temp;
+		recs[BENCH_RECORDS - 1].rh = data.rh;
+
+		start = k_cycle_get_32();
+		sys_put_le32(i, &buf[0]);
+		sys_put_le32(i, &buf[sizeof(uint32_t)]);
+		memcpy(&buf[BENCH_HDR_SIZE], recs, sizeof(recs));
+		cycles[BENCH_PACK][i] = k_cycle_get_32() - start;
+
+		start = k_cycle_get_32();
+		encode_delta(recs, BENCH_RECORDS, &buf[BENCH_HDR_SIZE], sizeof(buf) - BENCH_HDR_SIZE, &len);
+		cycles[BENCH_DELTA][i] = k_cycle_get_32() - start;
+
+		k_sem_reset(&sent_sem);
+		start = k_cycle_get_32();
+		ret = send(buf, BENCH_HDR_SIZE + len);
+		cycles[BENCH_SEND][i] = k_cycle_get_32() - start;
+
+		// wait outside the timing, the next send would only measure buffer exhaustion
+		if(ret || k_sem_take(&sent_sem, K_MSEC(BENCH_SENT_TIMEOUT_MS))){
+			errors[BENCH_SEND]++;
+		}
+	}
+
+	for(size_t i = 0; i < BENCH_STAGE_COUNT; i++){
+		print_stage(i, errors[i]);
+	}
+
+	k_thread_foreach(print_stack, NULL);
+	printk("bench done\n");
+}
@@ -0,0 +1,43 @@
+/* bench.h - Hot path latency benchmark */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <zephyr/types.h>
+
+/*
+ * With CONFIG_APP_BENCH the sample to notification pipeline is run
+ * CONFIG_APP_BENCH_ITERATIONS times at boot, before normal operation starts.
+ * It waits for a client to subscribe to TX, and after every notification for
+ * it to be sent, so the send stage times the real notify path. Every stage is
+ * timed with the cycle counter and the 50th, 90th and 99th
+ * percentile and maximum are printed, followed by the stack high-water mark
+ * of every thread. The output ends with "bench done" for the console harness.
+ */
+
+// Sends one encoded notification, e.g. to all subscribed clients
+typedef int (*bench_send_fn)(const uint8_t *buf, uint16_t len);
+
+#if defined(CONFIG_APP_BENCH)
+
+void bench_run(bench_send_fn send);
+
+// A client subscribed to TX, releases bench_run()
+void bench_subscribed(void);
+
+// A notification from bench_send_fn went out
+void bench_sent(void);
+
+#else
+
+static inline void bench_run(bench_send_fn send) {}
+static inline void bench_subscribed(void) {}
+static inline void bench_sent(void) {}
+
+#endif
+
+#endif /* BENCH_H_ */
@@ -0,0 +1,419 @@
+/* conn_policy.c - Connection parameter policy */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/gatt.h>
+#include <zephyr/bluetooth/hci.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+
+#include "conn_policy.h"
+
+LOG_MODULE_REGISTER(CONN_POLICY, CONFIG_APP_CONN_POLICY_LOG_LEVEL);
+
+#if defined(CONFIG_APP_CONN_POLICY)
+// Supervision timeout (10 ms units) must exceed (1 + latency) * interval (1.25 ms units) * 2
+#define TIMEOUT_VALID(timeout, latency, interval)	((timeout) * 4 > (1 + (latency)) * (interval))
+
+BUILD_ASSERT(CONFIG_APP_CONN_IDLE_INTERVAL_MIN <= CONFIG_APP_CONN_IDLE_INTERVAL_MAX);
+BUILD_ASSERT(CONFIG_APP_CONN_BURST_INTERVAL_MIN <= CONFIG_APP_CONN_BURST_INTERVAL_MAX);
+BUILD_ASSERT(TIMEOUT_VALID(CONFIG_APP_CONN_IDLE_TIMEOUT, CONFIG_APP_CONN_IDLE_LATENCY, CONFIG_APP_CONN_IDLE_INTERVAL_MAX),
+	"Idle supervision timeout too short for interval and latency");
+BUILD_ASSERT(TIMEOUT_VALID(CONFIG_APP_CONN_BURST_TIMEOUT, 0, CONFIG_APP_CONN_BURST_INTERVAL_MAX),
+	"Burst supervision timeout too short for interval");
+
+enum conn_mode{
+	CONN_MODE_DEFAULT,	// whatever the central chose
+	CONN_MODE_IDLE,
+	CONN_MODE_BURST
+};
+#endif
+
+#if defined(CONFIG_APP_CONN_PHY)
+BUILD_ASSERT(CONFIG_APP_CONN_PHY_RSSI_LOW < CONFIG_APP_CONN_PHY_RSSI_HIGH);
+
+// From fastest to longest range, the policy moves one step at a time
+enum conn_phy{
+	CONN_PHY_2M,
+	CONN_PHY_1M,
+	CONN_PHY_CODED
+};
+
+#if defined(CONFIG_APP_CONN_PHY_PREFER_CODED)
+#define CONN_PHY_PREFERRED		CONN_PHY_CODED
+#elif defined(CONFIG_APP_CONN_PHY_PREFER_1M)
+#define CONN_PHY_PREFERRED		CONN_PHY_1M
+#else
+#define CONN_PHY_PREFERRED		CONN_PHY_2M
+#endif
+
+#if defined(CONFIG_APP_CONN_PHY_CODED)
+#define CONN_PHY_SLOWEST		CONN_PHY_CODED
+#else
+#define CONN_PHY_SLOWEST		CONN_PHY_1M
+#endif
+
+static const struct bt_conn_le_phy_param phy_params[] = {
+	[CONN_PHY_2M] = { .options = BT_CONN_LE_PHY_OPT_NONE, .pref_tx_phy = BT_GAP_LE_PHY_2M, .pref_rx_phy = BT_GAP_LE_PHY_2M },
+	[CONN_PHY_1M] = { .options = BT_CONN_LE_PHY_OPT_NONE, .pref_tx_phy = BT_GAP_LE_PHY_1M, .pref_rx_phy = BT_GAP_LE_PHY_1M },
+	// S=8 coding for the most range
+	[CONN_PHY_CODED] = { .options = BT_CONN_LE_PHY_OPT_CODED_S8, .pref_tx_phy = BT_GAP_LE_PHY_CODED,
+		.pref_rx_phy = BT_GAP_LE_PHY_CODED }
+};
+#endif
+
+struct conn_policy_ctx{
+	struct bt_conn *conn;
+#if defined(CONFIG_APP_CONN_POLICY)
+	enum conn_mode mode;		// parameters the connection runs on
+	enum conn_mode pending;		// requested, not yet confirmed by an update
+	struct k_work_delayable idle_work;
+#endif
+#if defined(CONFIG_APP_CONN_PHY)
+	enum conn_phy phy;
+	atomic_t link_errors;
+	struct k_work_delayable phy_work;
+#endif
+};
+
+#if defined(CONFIG_APP_CONN_POLICY)
+static const struct bt_le_conn_param idle_param = BT_LE_CONN_PARAM_INIT(CONFIG_APP_CONN_IDLE_INTERVAL_MIN,
+	CONFIG_APP_CONN_IDLE_INTERVAL_MAX, CONFIG_APP_CONN_IDLE_LATENCY, CONFIG_APP_CONN_IDLE_TIMEOUT);
+static const struct bt_le_conn_param burst_param = BT_LE_CONN_PARAM_INIT(CONFIG_APP_CONN_BURST_INTERVAL_MIN,
+	CONFIG_APP_CONN_BURST_INTERVAL_MAX, 0, CONFIG_APP_CONN_BURST_TIMEOUT);
+#endif
+
+static struct conn_policy_ctx ctxs[CONFIG_BT_MAX_CONN];
+
+#if defined(CONFIG_APP_CONN_DATA_LEN)
+static struct bt_gatt_exchange_params mtu_params[CONFIG_BT_MAX_CONN];
+
+static void mtu_exchange_cb(struct bt_conn *conn, uint8_t err, struct bt_gatt_exchange_params *params)
+{
+	if(err){
+		LOG_WRN("MTU exchange error %u", err);
+		return;
+	}
+
+	LOG_DBG("MTU %u", bt_gatt_get_mtu(conn));
+}
+
+static void request_data_len(struct bt_conn *conn)
+{
+	int ret = 0;
+	struct bt_gatt_exchange_params *params = &mtu_params[bt_conn_index(conn)];
+
+	ret = bt_conn_le_data_len_update(conn, BT_LE_DATA_LEN_PARAM_MAX);
+	if(ret){
+		LOG_WRN("Data length update error %d", ret);
+	}
+
+	params->func = mtu_exchange_cb;
+	ret = bt_gatt_exchange_mtu(conn, params);
+	if(ret){
+		LOG_WRN("MTU exchange error %d", ret);
+	}
+}
+#endif
+
+#if defined(CONFIG_APP_CONN_POLICY)
+static const struct bt_le_conn_param *mode_param(enum conn_mode mode)
+{
+	return (mode == CONN_MODE_BURST) ? &burst_param : &idle_param;
+}
+
+static void request_mode(struct conn_policy_ctx *ctx, enum conn_mode mode)
+{
+	int ret = 0;
+
+	if(!ctx->conn || ctx->mode == mode || ctx->pending == mode){
+		return;
+	}
+
+	ret = bt_conn_le_param_update(ctx->conn, mode_param(mode));
+	if(ret == -EALREADY){
+		// already running on them, no update follows
+		ctx->pending = CONN_MODE_DEFAULT;
+		ctx->mode = mode;
+		return;
+	}
+
+	if(mode == CONN_MODE_IDLE){
+		// asked again unless conn_policy_param_updated() confirms it first
+		k_work_reschedule(&ctx->idle_work, K_MSEC(CONFIG_APP_CONN_IDLE_RETRY_MS));
+	}
+
+	if(ret){
+		LOG_WRN("Conn param update error %d", ret);
+		return;
+	}
+
+	LOG_DBG("Conn %u %s parameters requested", bt_conn_index(ctx->conn), (mode == CONN_MODE_BURST) ? "burst" : "idle");
+	ctx->pending = mode;
+}
+
+static void idle_work_handler(struct k_work *work)
+{
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	struct conn_policy_ctx *ctx = CONTAINER_OF(dwork, struct conn_policy_ctx, idle_work);
+
+	if(ctx->pending == CONN_MODE_IDLE){
+		// no update confirmed the last request, ask again
+		ctx->pending = CONN_MODE_DEFAULT;
+	}
+
+	request_mode(ctx, CONN_MODE_IDLE);
+}
+#endif
+
+#if defined(CONFIG_APP_CONN_PHY)
+static int read_rssi(struct bt_conn *conn, int8_t *rssi)
+{
+	int ret = 0;
+	uint16_t handle;
+	struct bt_hci_cp_read_rssi *cp;
+	struct bt_hci_rp_read_rssi *rp;
+	struct net_buf *buf;
+	struct net_buf *rsp = NULL;
+
+	ret = bt_hci_get_conn_handle(conn, &handle);
+	if(ret){
+		return ret;
+	}
+
+	buf = bt_hci_cmd_create(BT_HCI_OP_READ_RSSI, sizeof(*cp));
+	if(!buf){
+		return -ENOBUFS;
+	}
+
+	cp = net_buf_add(buf, sizeof(*cp));
+	cp->handle = sys_cpu_to_le16(handle);
+
+	ret = bt_hci_cmd_send_sync(BT_HCI_OP_READ_RSSI, buf, &rsp);
+	if(ret){
+		return ret;
+	}
+
+	rp = (void *)rsp->data;
+	if(rp->status){
+		LOG_DBG("Read RSSI status 0x%02x", rp->status);
+		ret = -EIO;
+	}
+	else{
+		*rssi = rp->rssi;
+	}
+
+	net_buf_unref(rsp);
+	return ret;
+}
+
+static void request_phy(struct conn_policy_ctx *ctx, enum conn_phy phy)
+{
+	int ret = 0;
+
+	if(phy == ctx->phy){
+		return;
+	}
+
+	ret = bt_conn_le_phy_update(ctx->conn, &phy_params[phy]);
+	if(ret){
+		LOG_WRN("PHY update error %d", ret);
+		return;
+	}
+
+	LOG_DBG("Conn %u PHY step %d requested", bt_conn_index(ctx->conn), phy);
+}
+
+/*
+ * Move one step towards range when the link keeps failing or the signal is
+ * weak, and one step back towards the preferred PHY once the signal is strong
+ * again.
+ */
+static void phy_work_handler(struct k_work *work)
+{
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	struct conn_policy_ctx *ctx = CONTAINER_OF(dwork, struct conn_policy_ctx, phy_work);
+	atomic_val_t errors = atomic_get(&ctx->link_errors);
+	int8_t rssi = 0;
+	int ret = 0;
+
+	if(!ctx->conn){
+		return;
+	}
+
+	ret = read_rssi(ctx->conn, &rssi);
+	if(ret){
+		LOG_WRN("Read RSSI error %d", ret);
+		// judge by link errors alone
+		rssi = (CONFIG_APP_CONN_PHY_RSSI_LOW + CONFIG_APP_CONN_PHY_RSSI_HIGH) / 2;
+	}
+
+	if(errors >= CONFIG_APP_CONN_PHY_ERROR_THRESHOLD || rssi < CONFIG_APP_CONN_PHY_RSSI_LOW){
+		if(ctx->phy < CONN_PHY_SLOWEST){
+			LOG_INF("Conn %u link weak, %d errors, RSSI %d", bt_conn_index(ctx->conn), (int)errors, rssi);
+			request_phy(ctx, ctx->phy + 1);
+		}
+		atomic_clear(&ctx->link_errors);
+	}
+	else if(!errors && rssi > CONFIG_APP_CONN_PHY_RSSI_HIGH && ctx->phy > CONN_PHY_PREFERRED){
+		request_phy(ctx, ctx->phy - 1);
+	}
+
+	k_work_reschedule(&ctx->phy_work, K_SECONDS(CONFIG_APP_CONN_PHY_CHECK_S));
+}
+#endif
+
+void conn_policy_init(void)
+{
+	for(size_t i = 0; i < ARRAY_SIZE(ctxs); i++){
+#if defined(CONFIG_APP_CONN_POLICY)
+		k_work_init_delayable(&ctxs[i].idle_work, idle_work_handler);
+#endif
+#if defined(CONFIG_APP_CONN_PHY)
+		k_work_init_delayable(&ctxs[i].phy_work, phy_work_handler);
+#endif
+	}
+}
+
+void conn_policy_connected(struct bt_conn *conn)
+{
+	struct conn_policy_ctx *ctx = &ctxs[bt_conn_index(conn)];
+
+	// the work handlers use it on the system work queue
+	ctx->conn = bt_conn_ref(conn);
+
+#if defined(CONFIG_APP_CONN_DATA_LEN)
+	request_data_len(conn);
+#endif
+
+#if defined(CONFIG_APP_CONN_PHY)
+	// every connection starts on 1M
+	ctx->phy = CONN_PHY_1M;
+	atomic_clear(&ctx->link_errors);
+	request_phy(ctx, CONN_PHY_PREFERRED);
+	k_work_reschedule(&ctx->phy_work, K_SECONDS(CONFIG_APP_CONN_PHY_CHECK_S));
+#endif
+
+#if defined(CONFIG_APP_CONN_POLICY)
+	ctx->mode = CONN_MODE_DEFAULT;
+	ctx->pending = CONN_MODE_DEFAULT;
+	// let the central finish discovery and pairing at its own pace first
+	k_work_reschedule(&ctx->idle_work, K_MSEC(CONFIG_APP_CONN_IDLE_DELAY_MS));
+#endif
+}
+
+void conn_policy_disconnected(struct bt_conn *conn)
+{
+	struct conn_policy_ctx *ctx = &ctxs[bt_conn_index(conn)];
+	struct k_work_sync sync __maybe_unused;
+
+	if(!ctx->conn){
+		return;
+	}
+
+	// waits for a handler still running with the connection
+#if defined(CONFIG_APP_CONN_POLICY)
+	k_work_cancel_delayable_sync(&ctx->idle_work, &sync);
+#endif
+#if defined(CONFIG_APP_CONN_PHY)
+	k_work_cancel_delayable_sync(&ctx->phy_work, &sync);
+#endif
+	bt_conn_unref(ctx->conn);
+	ctx->conn = NULL;
+}
+
+void conn_policy_burst_begin(struct bt_conn *conn)
+{
+#if defined(CONFIG_APP_CONN_POLICY)
+	struct conn_policy_ctx *ctx = &ctxs[bt_conn_index(conn)];
+
+	k_work_cancel_delayable(&ctx->idle_work);
+	request_mode(ctx, CONN_MODE_BURST);
+#endif
+}
+
+void conn_policy_burst_end(struct bt_conn *conn)
+{
+#if defined(CONFIG_APP_CONN_POLICY)
+	struct conn_policy_ctx *ctx = &ctxs[bt_conn_index(conn)];
+
+	if(!ctx->conn || ctx->mode == CONN_MODE_IDLE){
+		return;
+	}
+
+	k_work_reschedule(&ctx->idle_work, K_MSEC(CONFIG_APP_CONN_BURST_HOLD_MS));
+#endif
+}
+
+void conn_policy_link_error(struct bt_conn *conn)
+{
+#if defined(CONFIG_APP_CONN_PHY)
+	struct conn_policy_ctx *ctx = &ctxs[bt_conn_index(conn)];
+
+	if(atomic_inc(&ctx->link_errors) + 1 == CONFIG_APP_CONN_PHY_ERROR_THRESHOLD){
+		// don't wait for the next periodic check
+		k_work_reschedule(&ctx->phy_work, K_NO_WAIT);
+	}
+#endif
+}
+
+void conn_policy_link_ok(struct bt_conn *conn)
+{
+#if defined(CONFIG_APP_CONN_PHY)
+	atomic_clear(&ctxs[bt_conn_index(conn)].link_errors);
+#endif
+}
+
+void conn_policy_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency)
+{
+#if defined(CONFIG_APP_CONN_POLICY)
+	struct conn_policy_ctx *ctx = &ctxs[bt_conn_index(conn)];
+	// an update without a request of ours may still move the link off its mode
+	enum conn_mode target = (ctx->pending != CONN_MODE_DEFAULT) ? ctx->pending : ctx->mode;
+	const struct bt_le_conn_param *param = mode_param(target);
+
+	if(!ctx->conn || target == CONN_MODE_DEFAULT){
+		return;
+	}
+
+	ctx->pending = CONN_MODE_DEFAULT;
+	if(interval >= param->interval_min && interval <= param->interval_max && latency == param->latency){
+		ctx->mode = target;
+		if(target == CONN_MODE_IDLE){
+			k_work_cancel_delayable(&ctx->idle_work);
+		}
+		return;
+	}
+
+	LOG_WRN("Conn %u %s parameters not applied, interval %u latency %u", bt_conn_index(conn),
+		(target == CONN_MODE_BURST) ? "burst" : "idle", interval, latency);
+	ctx->mode = CONN_MODE_DEFAULT;
+	if(target == CONN_MODE_IDLE){
+		k_work_reschedule(&ctx->idle_work, K_MSEC(CONFIG_APP_CONN_IDLE_RETRY_MS));
+	}
+#endif
+}
+
+void conn_policy_phy_updated(struct bt_conn *conn, const struct bt_conn_le_phy_info *info)
+{
+#if defined(CONFIG_APP_CONN_PHY)
+	struct conn_policy_ctx *ctx = &ctxs[bt_conn_index(conn)];
+
+	switch(info->tx_phy){
+	case BT_GAP_LE_PHY_2M:
+		ctx->phy = CONN_PHY_2M;
+		break;
+	case BT_GAP_LE_PHY_CODED:
+		ctx->phy = CONN_PHY_CODED;
+		break;
+	default:
+		ctx->phy = CONN_PHY_1M;
+		break;
+	}
+#endif
+}
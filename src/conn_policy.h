@@ -0,0 +1,41 @@
+/* conn_policy.h - Connection parameter policy */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef CONN_POLICY_H_
+#define CONN_POLICY_H_
+
+#include <zephyr/bluetooth/conn.h>
+
+/*
+ * With CONFIG_APP_CONN_POLICY connections run with a long interval and
+ * peripheral latency while idle and are switched to a short interval while a
+ * burst of data (backfill or retries) is being transferred. Idle parameters
+ * are restored CONFIG_APP_CONN_BURST_HOLD_MS after the burst ends. A mode
+ * only counts once a parameter update confirms it; idle parameters the central
+ * rejects or changes are requested again every CONFIG_APP_CONN_IDLE_RETRY_MS.
+ *
+ * With CONFIG_APP_CONN_DATA_LEN the largest link layer data length and ATT
+ * MTU are requested as soon as a central connects, so notifications can
+ * carry a full batch in a single link layer packet.
+ *
+ * With CONFIG_APP_CONN_PHY the preferred PHY is requested on connect. Repeated
+ * link errors or a weak RSSI step the connection towards Coded PHY, a strong
+ * RSSI steps it back towards the preferred PHY.
+ */
+
+void conn_policy_init(void);
+void conn_policy_connected(struct bt_conn *conn);
+void conn_policy_disconnected(struct bt_conn *conn);
+void conn_policy_burst_begin(struct bt_conn *conn);
+void conn_policy_burst_end(struct bt_conn *conn);
+// A notification could not be sent or was not acknowledged in time
+void conn_policy_link_error(struct bt_conn *conn);
+void conn_policy_link_ok(struct bt_conn *conn);
+// Confirms requested parameters, or asks again for idle ones the central did not apply
+void conn_policy_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency);
+void conn_policy_phy_updated(struct bt_conn *conn, const struct bt_conn_le_phy_info *info);
+
+#endif /* CONN_POLICY_H_ */
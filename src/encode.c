@@ -0,0 +1,65 @@
+/* encode.c - Compact delta encoding of sample records */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/byteorder.h>
+#include <string.h>
+
+#include "encode.h"
+
+// Longest varint of a 32 bit value
+#define VARINT_MAX_SIZE		5
+
+static uint32_t zigzag(int32_t value)
+{
+	return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static size_t varint_put(uint32_t value, uint8_t *buf)
+{
+	size_t n = 0;
+
+	while(value >= 0x80){
+		buf[n++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	buf[n++] = (uint8_t)value;
+
+	return n;
+}
+
+size_t encode_delta(const struct sample_record *recs, size_t count, uint8_t *buf, size_t size, size_t *len)
+{
+	uint8_t tmp[3 * VARINT_MAX_SIZE];
+	size_t pos = 0;
+	size_t n;
+	size_t i;
+
+	*len = 0;
+	if(!count || size < sizeof(struct sample_record)){
+		return 0;
+	}
+
+	sys_put_le32(recs[0].timestamp, &buf[0]);
+	sys_put_le16((uint16_t)recs[0].temp, &buf[4]);
+	sys_put_le16(recs[0].rh, &buf[6]);
+	pos = sizeof(struct sample_record);
+
+	for(i = 1; i < count; i++){
+		n = varint_put(zigzag((int32_t)(recs[i].timestamp - recs[i - 1].timestamp)), tmp);
+		n += varint_put(zigzag(recs[i].temp - recs[i - 1].temp), &tmp[n]);
+		n += varint_put(zigzag(recs[i].rh - recs[i - 1].rh), &tmp[n]);
+		if(pos + n > size){
+			break;
+		}
+
+		memcpy(&buf[pos], tmp, n);
+		pos += n;
+	}
+
+	*len = pos;
+	return i;
+}
@@ -0,0 +1,31 @@
+/* encode.h - Compact delta encoding of sample records */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef ENCODE_H_
+#define ENCODE_H_
+
+#include <stddef.h>
+#include <zephyr/types.h>
+
+#include "sample.h"
+
+/*
+ * The first record is stored as is (8 bytes, little endian). Every following
+ * record is stored as the zig-zag varint encoded differences to the previous
+ * one: timestamp, temperature, humidity. Readings that change slowly take
+ * 3 to 4 bytes per record instead of 8.
+ */
+
+// Smallest possible encoding of a delta record
+#define ENCODE_DELTA_MIN_SIZE		3
+
+/*
+ * Encode as many of the count records as fit into size bytes of buf. Returns
+ * the number of records encoded and stores the bytes used in *len.
+ */
+size_t encode_delta(const struct sample_record *recs, size_t count, uint8_t *buf, size_t size, size_t *len);
+
+#endif /* ENCODE_H_ */
@@ -0,0 +1,230 @@
+/* log_chan.c - Bulk log transfer over an L2CAP channel */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/l2cap.h>
+#include <zephyr/logging/log.h>
+#include <string.h>
+
+#include "log_chan.h"
+#include "metrics.h"
+#include "sample_log.h"
+
+LOG_MODULE_REGISTER(LOG_CHAN, CONFIG_APP_LOG_CHAN_LOG_LEVEL);
+
+// Request: uint32 first log sequence number, uint32 count
+#define LOG_CHAN_REQ_SIZE			(2 * sizeof(uint32_t))
+// SDU: uint32 log sequence number of the first record, uint16 boot, sample records
+#define LOG_CHAN_HDR_SIZE			(sizeof(uint32_t) + sizeof(uint16_t))
+#define LOG_CHAN_SDU_SIZE			(LOG_CHAN_HDR_SIZE + CONFIG_APP_LOG_L2CAP_SDU_RECORDS * sizeof(struct sample_record))
+
+#define LOG_CHAN_FLAG_CONNECTED		0
+#define LOG_CHAN_FLAG_REQ			1
+
+NET_BUF_POOL_FIXED_DEFINE(log_chan_pool, CONFIG_APP_LOG_L2CAP_TX_BUFS, BT_L2CAP_SDU_BUF_SIZE(LOG_CHAN_SDU_SIZE),
+	CONFIG_BT_CONN_TX_USER_DATA_SIZE, NULL);
+
+static int log_chan_accept(struct bt_conn *conn, struct bt_l2cap_chan **chan);
+static void log_chan_connected(struct bt_l2cap_chan *chan);
+static void log_chan_disconnected(struct bt_l2cap_chan *chan);
+static int log_chan_recv(struct bt_l2cap_chan *chan, struct net_buf *buf);
+static void log_chan_sent(struct bt_l2cap_chan *chan);
+
+static const struct bt_l2cap_chan_ops log_chan_ops = {
+	.connected = log_chan_connected,
+	.disconnected = log_chan_disconnected,
+	.recv = log_chan_recv,
+	.sent = log_chan_sent
+};
+
+static struct bt_l2cap_server log_chan_server = {
+	.psm = CONFIG_APP_LOG_L2CAP_PSM,
+	.sec_level = BT_SECURITY_L1,
+	.accept = log_chan_accept
+};
+
+static struct bt_l2cap_le_chan le_chan;
+static atomic_t chan_flags;
+static bool chan_in_use;		// channel object handed to the stack
+static struct k_spinlock req_lock;
+static uint32_t req_seq;		// requested range, guarded by req_lock
+static uint32_t req_count;
+
+// Transfer state, only touched by fill_work
+static struct sample_log_cursor cursor;
+static uint32_t remaining;		// records still to send, plus one for the end marker
+
+static void fill_work_handler(struct k_work *work);
+
+static K_WORK_DEFINE(fill_work, fill_work_handler);
+
+static int log_chan_accept(struct bt_conn *conn, struct bt_l2cap_chan **chan)
+{
+	if(chan_in_use){
+		return -ENOMEM;
+	}
+
+	chan_in_use = true;
+	memset(&le_chan, 0, sizeof(le_chan));
+	le_chan.chan.ops = &log_chan_ops;
+	*chan = &le_chan.chan;
+
+	return 0;
+}
+
+static void log_chan_connected(struct bt_l2cap_chan *chan)
+{
+	LOG_INF("Log channel connected, tx MTU %u", le_chan.tx.mtu);
+	atomic_set_bit(&chan_flags, LOG_CHAN_FLAG_CONNECTED);
+}
+
+static void log_chan_disconnected(struct bt_l2cap_chan *chan)
+{
+	LOG_INF("Log channel disconnected");
+	atomic_clear(&chan_flags);
+	chan_in_use = false;
+	// drops the transfer
+	k_work_submit(&fill_work);
+}
+
+static int log_chan_recv(struct bt_l2cap_chan *chan, struct net_buf *buf)
+{
+	k_spinlock_key_t key;
+
+	if(buf->len != LOG_CHAN_REQ_SIZE){
+		LOG_WRN("Log channel request length %u", buf->len);
+		return 0;
+	}
+
+	key = k_spin_lock(&req_lock);
+	req_seq = sys_get_le32(&buf->data[0]);
+	req_count = sys_get_le32(&buf->data[sizeof(uint32_t)]);
+	k_spin_unlock(&req_lock, key);
+
+	// a new request replaces the one in progress
+	atomic_set_bit(&chan_flags, LOG_CHAN_FLAG_REQ);
+	k_work_submit(&fill_work);
+
+	return 0;
+}
+
+static void log_chan_sent(struct bt_l2cap_chan *chan)
+{
+	// a buffer is free again
+	k_work_submit(&fill_work);
+}
+
+static void start_transfer(void)
+{
+	uint32_t count;
+	uint32_t available;
+	k_spinlock_key_t key = k_spin_lock(&req_lock);
+
+	sample_log_cursor_init(&cursor, req_seq);
+	available = sample_log_next_seq() - req_seq;
+	if((int32_t)available < 0){
+		// starts past the newest record
+		available = 0;
+	}
+	// also keeps the end marker below from wrapping remaining
+	count = req_count ? MIN(req_count, available) : available;
+	k_spin_unlock(&req_lock, key);
+
+	remaining = count + 1;
+	LOG_INF("Log channel requested %u records from %u", count, cursor.seq);
+}
+
+/*
+ * Fill every free buffer of the pool with an SDU and queue it on the channel.
+ * Records are read from flash straight into the buffer. The stack sends as
+ * the peer grants credits; each sent SDU frees a buffer and runs this again.
+ */
+static void fill_work_handler(struct k_work *work)
+{
+	int ret = 0;
+	int count;
+	uint16_t boot;
+	uint32_t seq;
+	size_t max_records;
+	struct net_buf *buf;
+
+	if(!atomic_test_bit(&chan_flags, LOG_CHAN_FLAG_CONNECTED)){
+		remaining = 0;
+		return;
+	}
+
+	if(atomic_test_and_clear_bit(&chan_flags, LOG_CHAN_FLAG_REQ)){
+		start_transfer();
+	}
+
+	while(remaining){
+		buf = net_buf_alloc(&log_chan_pool, K_NO_WAIT);
+		if(!buf){
+			// continues from the sent callback
+			return;
+		}
+
+		net_buf_reserve(buf, BT_L2CAP_SDU_CHAN_SEND_RESERVE);
+		net_buf_add(buf, LOG_CHAN_HDR_SIZE);
+
+		count = 0;
+		boot = sample_log_boot();
+		if(remaining > 1){
+			max_records = MIN(MIN((size_t)(le_chan.tx.mtu - LOG_CHAN_HDR_SIZE), net_buf_tailroom(buf)) /
+				sizeof(struct sample_record), remaining - 1);
+			count = sample_log_read(&cursor, (struct sample_record *)net_buf_tail(buf), max_records, &boot);
+			if(count < 0){
+				METRIC_WRN(METRIC_LOG_ERROR, "Log read error %d", count);
+				count = 0;
+			}
+		}
+
+		if(count){
+			// the cursor may have skipped erased records
+			seq = cursor.seq - count;
+			remaining -= count;
+			net_buf_add(buf, count * sizeof(struct sample_record));
+		}
+		else{
+			// nothing left to read, finish with the end marker
+			seq = cursor.seq;
+			remaining = 0;
+		}
+
+		sys_put_le32(seq, &buf->data[0]);
+		sys_put_le16(boot, &buf->data[sizeof(uint32_t)]);
+
+		ret = bt_l2cap_chan_send(&le_chan.chan, buf);
+		if(ret < 0){
+			METRIC_WRN(METRIC_NOTIFY_ERROR, "Log channel send error %d", ret);
+			net_buf_unref(buf);
+			remaining = 0;
+			// the end marker would not get through either, tell the client the transfer is gone
+			ret = bt_l2cap_chan_disconnect(&le_chan.chan);
+			if(ret && ret != -ENOTCONN){
+				LOG_ERR("Log channel disconnect error %d", ret);
+			}
+			return;
+		}
+	}
+}
+
+int log_chan_init(void)
+{
+	int ret = 0;
+
+	ret = bt_l2cap_server_register(&log_chan_server);
+	if(ret){
+		LOG_ERR("L2CAP server register error %d", ret);
+	}
+
+	return ret;
+}
@@ -0,0 +1,37 @@
+/* log_chan.h - Bulk log transfer over an L2CAP channel */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef LOG_CHAN_H_
+#define LOG_CHAN_H_
+
+#include <errno.h>
+
+/*
+ * A gateway catching up on a long outage opens an LE credit based channel on
+ * PSM CONFIG_APP_LOG_L2CAP_PSM and sends a request SDU: uint32 first log
+ * sequence number, uint32 record count, 0 for everything up to the newest
+ * record. The requested records are streamed back as SDUs in the LOG
+ * characteristic format (uint32 sequence number of the first record, uint16
+ * boot, sample records) as fast as the channel credits allow, ending with an
+ * SDU without records. Counts past the newest record are cut to it. A send
+ * error disconnects the channel, so a transfer without its end marker has
+ * failed. One channel is served at a time.
+ */
+
+#if defined(CONFIG_APP_LOG_L2CAP)
+
+int log_chan_init(void);
+
+#else
+
+static inline int log_chan_init(void)
+{
+	return -ENOTSUP;
+}
+
+#endif
+
+#endif /* LOG_CHAN_H_ */
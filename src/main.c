@@ -16,37 +16,133 @@
 #include <zephyr/bluetooth/conn.h>
 #include <zephyr/bluetooth/uuid.h>
 #include <zephyr/bluetooth/gatt.h>
-#include <zephyr/device.h>
-#include <zephyr/drivers/sensor.h>
 #include <zephyr/logging/log.h>
-
-LOG_MODULE_REGISTER(MAIN);
-
-#define MAIN_SERVICE_UUID	BT_UUID_128_ENCODE(0xedd1a5f3, 0xdbb0, 0x4b29, 0xb449, 0xa4be5161f18e)
-#define RX_UUID				BT_UUID_128_ENCODE(0xedd1a5f3, 0xdbb2, 0x4b29, 0xb449, 0xa4be5161f18e)
-#define TX_UUID				BT_UUID_128_ENCODE(0xedd1a5f3, 0xdbb3, 0x4b29, 0xb449, 0xa4be5161f18e)
-
-#define MAIN_EVT_TIMER_EXPIRY			0x01
+#include <zephyr/settings/settings.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "adv.h"
+#include "aggregate.h"
+#include "bench.h"
+#include "conn_policy.h"
+#include "encode.h"
+#include "log_chan.h"
+#include "metrics.h"
+#include "report_filter.h"
+#include "retry.h"
+#include "sampler.h"
+#include "sample_buf.h"
+#include "sample_log.h"
+#include "sht41.h"
+#include "timesync.h"
+#include "uuids.h"
+#include "wake_stats.h"
+
+LOG_MODULE_REGISTER(MAIN, CONFIG_APP_MAIN_LOG_LEVEL);
+
+#define MAIN_EVT_SAMPLE					0x01
 #define MAIN_EVT_BLE_RESP_RECEIVED		0x02
+#define MAIN_EVT_BACKFILL				0x04
+#define MAIN_EVT_SCHEDULE				0x08
 
 #define TIMER_INTERVAL_MINUTES			15
+#define SAMPLE_INTERVAL_MIN_SECONDS		10
+#define RESP_TIMEOUT_SECONDS			5
+
+// Notification payload: uint32 sequence number of the first record, uint32 device uptime (s), sample records
+#define TX_HDR_SIZE						(2 * sizeof(uint32_t))
+#define TX_BUF_SIZE						(CONFIG_BT_L2CAP_TX_MTU - 3)
+#define TX_MAX_RECORDS					((TX_BUF_SIZE - TX_HDR_SIZE) / sizeof(struct sample_record))
+// Most delta encoded records that can fit into one notification
+#define TX_MAX_DELTA_RECORDS			(1 + (TX_BUF_SIZE - TX_HDR_SIZE - sizeof(struct sample_record)) / ENCODE_DELTA_MIN_SIZE)
 
 #define BLE_PASSKEY						123456
 
-#define SHT41_NODE						DT_NODELABEL(sht41)
+// Legacy single command writes
+#define RX_CMD_ACK						0x00
+#define RX_CMD_RETRY					0x01
+
+// Writes starting at 0x10 or above are a list of type, length, value commands
+#define RX_TLV_FIRST					0x10
+#define RX_TLV_SET_INTERVAL				0x10	// uint16 sample interval in seconds
+#define RX_TLV_SET_PRECISION			0x11	// uint8 enum sht41_precision
+#define RX_TLV_LOG_RANGE				0x12	// uint32 first log sequence number, uint16 count
+#define RX_TLV_READ_NOW					0x13	// no value
+#define RX_TLV_SET_DEADBAND				0x14	// uint16 centi-degrees C, uint16 centi-percent, uint8 max skipped
+#define RX_TLV_SET_ENCODING				0x15	// uint8 enum tx_encoding, for this connection
+#define RX_TLV_SET_MAX_AGE				0x16	// uint16 seconds a read may serve the cached sample, for this connection
+#define RX_TLV_TIME_SYNC				0x17	// uint64 Unix time in milliseconds
+#define RX_TLV_SET_SLOT					0x18	// uint16 period (s), uint16 offset into the period (s)
+
+// Read value: sample record, uint32 age of the sample (s)
+#define TX_READ_SIZE					(sizeof(struct sample_record) + sizeof(uint32_t))
+// Metrics read value, see README.rst
+#define METRICS_READ_SIZE				(12 * sizeof(uint32_t) + 3 * sizeof(uint16_t))
+
+enum tx_encoding{
+	TX_ENCODING_RAW = 0,	// 8 byte records
+	TX_ENCODING_DELTA = 1	// see encode.h
+};
+
+// Log notification payload: uint32 log sequence number of the first record, uint16 boot, sample records
+#define LOG_HDR_SIZE					(sizeof(uint32_t) + sizeof(uint16_t))
 
-struct sht41_data{
-	double temp;
-	double rh;
+#define TX_WINDOW						CONFIG_APP_TX_WINDOW
+
+#define PEER_FLAG_NEW					0	// connected, state not set up yet
+#define PEER_FLAG_ACK					1	// cumulative ack received
+#define PEER_FLAG_RETRY					2	// client asked for a resend
+#define PEER_FLAG_LOG_REQ				3	// log range requested
+#define PEER_FLAG_LOG_BUSY				4	// log notification being sent
+
+/*
+ * Per connection transmit state, indexed by bt_conn_index(). Only conn and
+ * flags are touched from Bluetooth callbacks, everything else belongs to the
+ * main thread so a slow peer never holds up the others.
+ */
+struct peer{
+	struct bt_conn *conn;
+	atomic_t flags;
+	atomic_t ack_seq;		// latest cumulative ack, first sequence number not yet received
+	atomic_t legacy_acks;	// bare 0x00 acks, each one acknowledges the oldest notification
+	bool active;
+	bt_addr_le_t addr;
+	uint32_t tx_seq;		// oldest sample not acknowledged by this peer
+	uint32_t send_seq;		// next sample to send
+	atomic_t encoding;		// enum tx_encoding chosen by the client
+	atomic_t max_age_s;		// age after which a read refreshes the cached sample, 0 never
+	uint32_t batch_end[TX_WINDOW];	// end sequence number of each notification in flight
+	uint32_t batch_sent[TX_WINDOW];	// wake_stats_start() when each notification was sent
+	uint32_t batch_sent_ms[TX_WINDOW];	// uptime when each notification was sent
+	uint8_t batch_head;		// oldest notification in flight
+	uint8_t in_flight;		// notifications awaiting ack
+	int64_t ack_deadline;
+	int64_t retry_at;		// 0 when no retry is pending
+	struct retry_state retry;
+	uint32_t log_req_seq;	// requested log range, guarded by peers_lock
+	uint16_t log_req_count;
+	struct sample_log_cursor log_cursor;
+	uint32_t log_remaining;	// records of the requested range still to send
+};
+
+// Where a recently connected peer stopped, so a reconnecting gateway resumes there
+struct peer_cursor{
+	bool used;
+	bt_addr_le_t addr;
+	uint32_t tx_seq;
 };
 
 static ssize_t rx_chr_written(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf, uint16_t len, uint16_t offset, uint8_t flags);
 static ssize_t tx_chr_read_cb(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset);
 static void tx_chr_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value);
+static ssize_t metrics_chr_read_cb(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset);
 
 static void connected_cb(struct bt_conn *conn, uint8_t err);
 static void disconnected_cb(struct bt_conn *conn, uint8_t reason);
 static void security_changed_cb(struct bt_conn *conn, bt_security_t level, enum bt_security_err err);
+static void le_param_updated_cb(struct bt_conn *conn, uint16_t interval, uint16_t latency, uint16_t timeout);
+#if defined(CONFIG_BT_USER_PHY_UPDATE)
+static void le_phy_updated_cb(struct bt_conn *conn, struct bt_conn_le_phy_info *param);
+#endif
 
 static void pair_cancel(struct bt_conn *conn);
 static void pairing_confirm(struct bt_conn *conn);
@@ -57,67 +153,342 @@ static void pairing_complete(struct bt_conn *conn, bool bonded);
 static void pairing_failed(struct bt_conn *conn, enum bt_security_err reason);
 static void bond_deleted(uint8_t id, const bt_addr_le_t *peer);
 
-static void sensor_timer_expiry_handler(struct k_timer *timer);
-
-const struct bt_uuid_128 main_service_uuid = BT_UUID_INIT_128(MAIN_SERVICE_UUID);
-const struct bt_uuid_128 tx_uuid = BT_UUID_INIT_128(TX_UUID);
-const struct bt_uuid_128 rx_uuid = BT_UUID_INIT_128(RX_UUID);
-struct bt_conn *conn;
+static void att_mtu_updated_cb(struct bt_conn *conn, uint16_t tx, uint16_t rx);
 
-struct bt_conn_cb conn_callbacks = {
+// Connection callbacks live in an iterable section in flash, no registration
+BT_CONN_CB_DEFINE(conn_callbacks) = {
 	.connected = connected_cb,
 	.disconnected = disconnected_cb,
-	.security_changed = security_changed_cb
+	.security_changed = security_changed_cb,
+	.le_param_updated = le_param_updated_cb,
+#if defined(CONFIG_BT_USER_PHY_UPDATE)
+	.le_phy_updated = le_phy_updated_cb
+#endif
+};
+// Linked into a list by the stack, has to stay writable
+static struct bt_gatt_cb gatt_callbacks = {
+	.att_mtu_updated = att_mtu_updated_cb
 };
-struct bt_conn_auth_cb conn_auth_callbacks = {
+static const struct bt_conn_auth_cb conn_auth_callbacks = {
 	.cancel = pair_cancel,
 	.pairing_confirm = pairing_confirm,
 	.passkey_display = passkey_display,
 	.passkey_confirm = NULL,
 };
-struct bt_conn_auth_info_cb conn_auth_info_callbacks = {
+// Linked into a list by the stack, has to stay writable
+static struct bt_conn_auth_info_cb conn_auth_info_callbacks = {
 	.pairing_complete = pairing_complete,
 	.pairing_failed = pairing_failed,
 	.bond_deleted = bond_deleted
 };
 
-bool notifications_enabled = false;
+// Scalar application state, main thread only, largest members first to keep padding to the end
+static struct app_state{
+#if defined(CONFIG_APP_AGGREGATE)
+	int64_t window_end;			// uptime from which a sample closes the open aggregation window
+#endif
+	int64_t slot_anchor_ms;		// uptime of a slot start, the others follow every slot period
+	uint32_t sample_interval_s;
+	uint32_t pair_passkey;
+	uint16_t slot_period_s;		// assigned sampling slot, 0 when none
+	uint16_t slot_offset_s;
+	uint8_t peer_cursor_next;	// peer_cursors entry replaced next
+} app = {
+	.sample_interval_s = TIMER_INTERVAL_MINUTES * 60
+};
 
-const struct device *sht41 = DEVICE_DT_GET(SHT41_NODE);
-struct sht41_data sht41_sensor_data;
+BUILD_ASSERT(CONFIG_APP_PEER_CURSORS <= UINT8_MAX);
 
-unsigned int pair_passkey = 0;
+// Sampling schedule written by a client, applied to app by the main thread
+static struct k_spinlock sched_lock;
+static struct{
+	uint16_t interval_s;
+	uint16_t slot_period_s;		// 0 for a plain interval
+	uint16_t slot_offset_s;
+	bool pending;
+	bool realign;				// time synced, move the slot onto the new clock
+} sched_req;
 
-// Sensor timer definition
-K_TIMER_DEFINE(sensor_timer, sensor_timer_expiry_handler, NULL);
+static struct peer peers[CONFIG_BT_MAX_CONN];
+static struct k_spinlock peers_lock;
+static struct peer_cursor peer_cursors[CONFIG_APP_PEER_CURSORS];
+static uint8_t tx_buf[TX_BUF_SIZE];
+static struct sample_record tx_records[TX_MAX_DELTA_RECORDS];
 
 // Events
 K_EVENT_DEFINE(main_evts);
 
-static const struct bt_data adv_data [] = {
-	BT_DATA_BYTES(BT_DATA_FLAGS, BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR),
-	BT_DATA_BYTES(BT_DATA_UUID128_ALL, MAIN_SERVICE_UUID)
-};
-
 BT_GATT_SERVICE_DEFINE(primary_service, 
 	BT_GATT_PRIMARY_SERVICE(BT_UUID_DECLARE_128(MAIN_SERVICE_UUID)),
 	BT_GATT_CHARACTERISTIC(BT_UUID_DECLARE_128(RX_UUID), BT_GATT_CHRC_WRITE, BT_GATT_PERM_WRITE, NULL, rx_chr_written, NULL),
-	BT_GATT_CHARACTERISTIC(BT_UUID_DECLARE_128(TX_UUID), BT_GATT_CHRC_NOTIFY, BT_GATT_PERM_READ, tx_chr_read_cb, NULL, NULL),
+	BT_GATT_CHARACTERISTIC(BT_UUID_DECLARE_128(TX_UUID), BT_GATT_CHRC_READ | BT_GATT_CHRC_NOTIFY, BT_GATT_PERM_READ, tx_chr_read_cb, NULL, NULL),
 	BT_GATT_CCC(tx_chr_ccc_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+	BT_GATT_CHARACTERISTIC(BT_UUID_DECLARE_128(LOG_UUID), BT_GATT_CHRC_NOTIFY, BT_GATT_PERM_NONE, NULL, NULL, NULL),
+	BT_GATT_CCC(NULL, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+	BT_GATT_CHARACTERISTIC(BT_UUID_DECLARE_128(METRICS_UUID), BT_GATT_CHRC_READ, BT_GATT_PERM_READ, metrics_chr_read_cb, NULL, NULL),
 );
 
+#define TX_ATTR							(&primary_service.attrs[3])
+#define LOG_ATTR						(&primary_service.attrs[6])
+
+// Time between sensor reads, shorter than the report interval while aggregating
+static uint32_t sample_period_ms(void)
+{
+	if(IS_ENABLED(CONFIG_APP_AGGREGATE)){
+		return MIN(CONFIG_APP_AGGREGATE_SAMPLE_S, app.sample_interval_s) * MSEC_PER_SEC;
+	}
+
+	return app.sample_interval_s * MSEC_PER_SEC;
+}
+
+/*
+ * Start sampling at the assigned slot. Once the time is synced slots are
+ * offsets into every period of Unix time, so gateways can spread a fleet
+ * evenly over the period; before that the offset counts from now.
+ */
+static void slot_align(void)
+{
+	int64_t unix_ms = timesync_unix_ms(k_uptime_get());
+	int64_t period_ms = (int64_t)app.slot_period_s * MSEC_PER_SEC;
+	int64_t offset_ms = (int64_t)app.slot_offset_s * MSEC_PER_SEC;
+	uint32_t delay = (uint32_t)offset_ms;
+
+	if(unix_ms >= 0){
+		delay = (uint32_t)((offset_ms - unix_ms % period_ms + period_ms) % period_ms);
+	}
+
+	LOG_INF("Slot %u/%u s, next sample in %u ms", app.slot_offset_s, app.slot_period_s, delay);
+	app.slot_anchor_ms = k_uptime_get() + delay;
+	sampler_align(sample_period_ms(), delay);
+}
+
+#if defined(CONFIG_APP_AGGREGATE)
+// Uptime of the first slot start after uptime
+static int64_t slot_next_ms(int64_t uptime)
+{
+	int64_t period_ms = (int64_t)app.slot_period_s * MSEC_PER_SEC;
+
+	if(uptime <= app.slot_anchor_ms){
+		return app.slot_anchor_ms;
+	}
+
+	return app.slot_anchor_ms + ((uptime - app.slot_anchor_ms + period_ms - 1) / period_ms) * period_ms;
+}
+#endif
+
+// Take over the schedule a client wrote, interval and slot change together
+static void schedule_apply(void)
+{
+	bool pending;
+	bool realign;
+	k_spinlock_key_t key = k_spin_lock(&sched_lock);
+
+	pending = sched_req.pending;
+	realign = sched_req.realign;
+	sched_req.pending = false;
+	sched_req.realign = false;
+	if(pending){
+		app.sample_interval_s = sched_req.interval_s;
+		app.slot_period_s = sched_req.slot_period_s;
+		app.slot_offset_s = sched_req.slot_offset_s;
+	}
+	k_spin_unlock(&sched_lock, key);
+
+	// a sync leaves a plain interval running as it is
+	if(!pending && !(realign && app.slot_period_s)){
+		return;
+	}
+
+	if(app.slot_period_s){
+		// also moves the slot anchor onto the synced clock
+		slot_align();
+	}
+	else{
+		LOG_INF("Sample interval %u s", app.sample_interval_s);
+		sampler_set_period(sample_period_ms());
+	}
+}
+
+// Apply one TLV command, returns 0 or an ATT error
+static uint8_t rx_tlv_apply(struct peer *peer, uint8_t type, const uint8_t *value, uint8_t len)
+{
+	uint16_t interval;
+	k_spinlock_key_t key;
+
+	switch(type){
+	case RX_TLV_SET_INTERVAL:
+		if(len != sizeof(uint16_t)){
+			return BT_ATT_ERR_INVALID_ATTRIBUTE_LEN;
+		}
+
+		interval = sys_get_le16(value);
+		if(interval < SAMPLE_INTERVAL_MIN_SECONDS){
+			return BT_ATT_ERR_VALUE_NOT_ALLOWED;
+		}
+
+		key = k_spin_lock(&sched_lock);
+		sched_req.interval_s = interval;
+		// an explicit interval replaces the slot
+		sched_req.slot_period_s = 0;
+		sched_req.slot_offset_s = 0;
+		sched_req.pending = true;
+		k_spin_unlock(&sched_lock, key);
+		k_event_post(&main_evts, MAIN_EVT_SCHEDULE);
+		break;
+
+	case RX_TLV_SET_PRECISION:
+		if(len != sizeof(uint8_t)){
+			return BT_ATT_ERR_INVALID_ATTRIBUTE_LEN;
+		}
+
+		if(value[0] > SHT41_PRECISION_AUTO){
+			return BT_ATT_ERR_VALUE_NOT_ALLOWED;
+		}
+
+		LOG_INF("Sensor precision %u", value[0]);
+		sht41_set_precision(value[0]);
+		break;
+
+	case RX_TLV_LOG_RANGE:
+		if(len != sizeof(uint32_t) + sizeof(uint16_t)){
+			return BT_ATT_ERR_INVALID_ATTRIBUTE_LEN;
+		}
+
+		key = k_spin_lock(&peers_lock);
+		peer->log_req_seq = sys_get_le32(value);
+		peer->log_req_count = sys_get_le16(&value[sizeof(uint32_t)]);
+		k_spin_unlock(&peers_lock, key);
+		atomic_set_bit(&peer->flags, PEER_FLAG_LOG_REQ);
+		k_event_post(&main_evts, MAIN_EVT_BACKFILL);
+		break;
+
+	case RX_TLV_READ_NOW:
+		sampler_read_now();
+		break;
+
+	case RX_TLV_SET_DEADBAND:
+		if(len != 2 * sizeof(uint16_t) + sizeof(uint8_t)){
+			return BT_ATT_ERR_INVALID_ATTRIBUTE_LEN;
+		}
+
+		report_filter_set(sys_get_le16(value), sys_get_le16(&value[2]), value[4]);
+		LOG_INF("Deadband %u/%u, max skip %u", sys_get_le16(value), sys_get_le16(&value[2]), value[4]);
+		break;
+
+	case RX_TLV_SET_ENCODING:
+		if(len != sizeof(uint8_t)){
+			return BT_ATT_ERR_INVALID_ATTRIBUTE_LEN;
+		}
+
+		if(value[0] > TX_ENCODING_DELTA){
+			return BT_ATT_ERR_VALUE_NOT_ALLOWED;
+		}
+
+		atomic_set(&peer->encoding, value[0]);
+		break;
+
+	case RX_TLV_SET_MAX_AGE:
+		if(len != sizeof(uint16_t)){
+			return BT_ATT_ERR_INVALID_ATTRIBUTE_LEN;
+		}
+
+		atomic_set(&peer->max_age_s, sys_get_le16(value));
+		break;
+
+	case RX_TLV_TIME_SYNC:
+		if(len != sizeof(uint64_t)){
+			return BT_ATT_ERR_INVALID_ATTRIBUTE_LEN;
+		}
+
+		if(timesync_set(sys_get_le64(value))){
+			return BT_ATT_ERR_VALUE_NOT_ALLOWED;
+		}
+
+		// the slot anchor belongs to the main thread
+		key = k_spin_lock(&sched_lock);
+		sched_req.realign = true;
+		k_spin_unlock(&sched_lock, key);
+		k_event_post(&main_evts, MAIN_EVT_SCHEDULE);
+		break;
+
+	case RX_TLV_SET_SLOT:
+		if(len != 2 * sizeof(uint16_t)){
+			return BT_ATT_ERR_INVALID_ATTRIBUTE_LEN;
+		}
+
+		interval = sys_get_le16(value);
+		if(interval < SAMPLE_INTERVAL_MIN_SECONDS || sys_get_le16(&value[2]) >= interval){
+			return BT_ATT_ERR_VALUE_NOT_ALLOWED;
+		}
+
+		key = k_spin_lock(&sched_lock);
+		sched_req.interval_s = interval;
+		sched_req.slot_period_s = interval;
+		sched_req.slot_offset_s = sys_get_le16(&value[2]);
+		sched_req.pending = true;
+		k_spin_unlock(&sched_lock, key);
+		k_event_post(&main_evts, MAIN_EVT_SCHEDULE);
+		break;
+
+	default:
+		LOG_DBG("Unknown command 0x%02x", type);
+		return BT_ATT_ERR_NOT_SUPPORTED;
+	}
+
+	return 0;
+}
+
+static ssize_t rx_tlv_parse(struct peer *peer, const uint8_t *data, uint16_t len)
+{
+	uint8_t err;
+	uint16_t pos = 0;
+
+	while(pos < len){
+		if(len - pos < 2 || len - pos - 2 < data[pos + 1]){
+			return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+		}
+
+		err = rx_tlv_apply(peer, data[pos], &data[pos + 2], data[pos + 1]);
+		if(err){
+			return BT_GATT_ERR(err);
+		}
+
+		pos += 2 + data[pos + 1];
+	}
+
+	return len;
+}
+
 static ssize_t rx_chr_written(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf, uint16_t len, uint16_t offset, uint8_t flags)
 {
 	LOG_DBG("Data Received");
 	const uint8_t *data = (char *) buf;
-	if(data[0] == 0x00){
-		LOG_INF("Response received");
-		k_event_set(&main_evts, MAIN_EVT_BLE_RESP_RECEIVED);
+	struct peer *peer = &peers[bt_conn_index(conn)];
+	if(!len){
+		return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+	}
+
+	if(data[0] >= RX_TLV_FIRST){
+		return rx_tlv_parse(peer, data, len);
 	}
-	else if(data[0] == 0x01){
+
+	if(data[0] == RX_CMD_ACK){
+		LOG_DBG("Response received");
+		if(len >= 1 + sizeof(uint32_t)){
+			// cumulative ack: everything before this sequence number was received
+			atomic_set(&peer->ack_seq, (atomic_val_t)sys_get_le32(&data[1]));
+			atomic_set_bit(&peer->flags, PEER_FLAG_ACK);
+		}
+		else{
+			atomic_inc(&peer->legacy_acks);
+		}
+		k_event_post(&main_evts, MAIN_EVT_BLE_RESP_RECEIVED);
+	}
+	else if(data[0] == RX_CMD_RETRY){
 		// retry
 		LOG_DBG("Retry");
-		k_timer_start(&sensor_timer, K_SECONDS(15), K_SECONDS(15));
+		atomic_set_bit(&peer->flags, PEER_FLAG_RETRY);
+		k_event_post(&main_evts, MAIN_EVT_BACKFILL);
 	}
 	else{
 		LOG_DBG("Unexpected response %d", data[0]);
@@ -126,38 +497,158 @@ static ssize_t rx_chr_written(struct bt_conn *conn, const struct bt_gatt_attr *a
 	return len;
 }
 
+/*
+ * Serve the latest reading from the cache without waiting for the sensor. A
+ * stale cache is refreshed in the background, so the next read gets a new
+ * sample, and polling faster than the max age never reads the sensor twice.
+ */
 static ssize_t tx_chr_read_cb(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset)
 {
+	uint8_t value[TX_READ_SIZE];
+	struct sample_record rec;
+	uint32_t max_age = (uint32_t)atomic_get(&peers[bt_conn_index(conn)].max_age_s);
+	uint32_t age;
+
 	LOG_DBG("TX read");
-	return 0;
+	if(sampler_latest(&rec, &age)){
+		return 0;
+	}
+
+	if(max_age && age >= max_age){
+		sampler_refresh(max_age);
+	}
+
+	memcpy(value, &rec, sizeof(rec));
+	sys_put_le32(age, &value[sizeof(rec)]);
+
+	return bt_gatt_attr_read(conn, attr, buf, len, offset, value, sizeof(value));
+}
+
+static ssize_t metrics_chr_read_cb(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset)
+{
+	uint8_t value[METRICS_READ_SIZE];
+	uint8_t *pos = value;
+	uint32_t retries = 0;
+	uint32_t acks = metrics_get(METRIC_ACK);
+	uint32_t rtt = acks ? metrics_get(METRIC_ACK_RTT_MS) / acks : 0;
+	static const enum metric counters[] = {
+		METRIC_SAMPLE, METRIC_FETCH_ERROR, METRIC_NOTIFY_ERROR, METRIC_ACK_TIMEOUT
+	};
+
+	for(size_t i = 0; i < RETRY_REASON_COUNT; i++){
+		retries += retry_count(i);
+	}
+
+	sys_put_le32((uint32_t)(k_uptime_get() / MSEC_PER_SEC), pos);
+	pos += sizeof(uint32_t);
+	for(size_t i = 0; i < ARRAY_SIZE(counters); i++){
+		sys_put_le32(metrics_get(counters[i]), pos);
+		pos += sizeof(uint32_t);
+	}
+	sys_put_le32(retries, pos);
+	sys_put_le32(metrics_get(METRIC_BYTES_SENT), pos + 4);
+	sys_put_le16((uint16_t)MIN(rtt, UINT16_MAX), pos + 8);
+	sys_put_le16((uint16_t)(sample_buf_next_seq() - sample_buf_oldest_seq()), pos + 10);
+	sys_put_le16(CONFIG_APP_SAMPLE_BUF_SIZE, pos + 12);
+	pos += 14;
+	sys_put_le32(sample_log_next_seq() - sample_log_oldest_seq(), pos);
+	sys_put_le32(metrics_get(METRIC_CONNECT), pos + 4);
+	sys_put_le32(metrics_get(METRIC_RECONNECT), pos + 8);
+	sys_put_le32(metrics_get(METRIC_DISCONNECT), pos + 12);
+	sys_put_le32(metrics_get(METRIC_SAMPLE_OVERWRITTEN), pos + 16);
+
+	return bt_gatt_attr_read(conn, attr, buf, len, offset, value, sizeof(value));
 }
 
 static void tx_chr_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value)
 {
+	// value is the aggregate of all peers, each peer's subscription is checked when sending
 	if(value){
-		notifications_enabled = true;
-		// start timer
-		k_timer_start(&sensor_timer, K_MINUTES(TIMER_INTERVAL_MINUTES), K_MINUTES(TIMER_INTERVAL_MINUTES));
 		LOG_INF("TX notifications enabled");
+		bench_subscribed();
 	}
 	else{
-		notifications_enabled = false;
-		// stop timer to conserve power
-		k_timer_stop(&sensor_timer);
+		// keep sampling, readings are buffered until a client returns
 		LOG_WRN("TX notifications disabled");
 	}
+
+	// send whatever was buffered while nobody was listening
+	k_event_post(&main_evts, MAIN_EVT_BACKFILL);
+}
+
+static size_t peers_connected(void)
+{
+	size_t count = 0;
+	k_spinlock_key_t key = k_spin_lock(&peers_lock);
+
+	for(size_t i = 0; i < ARRAY_SIZE(peers); i++){
+		if(peers[i].conn){
+			count++;
+		}
+	}
+
+	k_spin_unlock(&peers_lock, key);
+	return count;
 }
 
 static void connected_cb(struct bt_conn *conn, uint8_t err)
 {
+	struct peer *peer;
+	k_spinlock_key_t key;
+
 	LOG_INF("Device connected, %d", err);
-	bt_conn_ref(conn);
+	if(err){
+		adv_restart();
+		return;
+	}
+
+	metrics_inc(METRIC_CONNECT);
+
+	peer = &peers[bt_conn_index(conn)];
+	// client settings, before the connection takes RX writes
+	atomic_clear_bit(&peer->flags, PEER_FLAG_LOG_REQ);
+	atomic_set(&peer->encoding, TX_ENCODING_RAW);
+	atomic_set(&peer->max_age_s, CONFIG_APP_READ_MAX_AGE_S);
+	key = k_spin_lock(&peers_lock);
+	peer->log_req_seq = 0;
+	peer->log_req_count = 0;
+	peer->conn = bt_conn_ref(conn);
+	k_spin_unlock(&peers_lock, key);
+	atomic_set_bit(&peer->flags, PEER_FLAG_NEW);
+
+	adv_connected();
+	conn_policy_connected(conn);
+
+	// keep advertising while there is room for another gateway
+	if(peers_connected() < CONFIG_BT_MAX_CONN){
+		adv_restart();
+	}
+
+	k_event_post(&main_evts, MAIN_EVT_BACKFILL);
 }
 
 static void disconnected_cb(struct bt_conn *conn, uint8_t reason)
 {
+	struct peer *peer = &peers[bt_conn_index(conn)];
+	struct bt_conn *old;
+	k_spinlock_key_t key;
+
 	LOG_WRN("Device disconnected %d", reason);
-	bt_conn_unref(conn);
+	metrics_inc(METRIC_DISCONNECT);
+	conn_policy_disconnected(conn);
+	// no client to hold the staged samples, persist them
+	sample_log_flush_async();
+
+	key = k_spin_lock(&peers_lock);
+	old = peer->conn;
+	peer->conn = NULL;
+	k_spin_unlock(&peers_lock, key);
+	if(old){
+		bt_conn_unref(old);
+	}
+
+	adv_restart();
+	k_event_post(&main_evts, MAIN_EVT_BACKFILL);
 }
 
 static void security_changed_cb(struct bt_conn *conn, bt_security_t level, enum bt_security_err err)
@@ -168,6 +659,29 @@ static void security_changed_cb(struct bt_conn *conn, bt_security_t level, enum
 	}
 
 	LOG_DBG("Security updated to %d", level);
+	// the subscriptions of a bonded peer are restored with its keys
+	k_event_post(&main_evts, MAIN_EVT_BACKFILL);
+}
+
+static void le_param_updated_cb(struct bt_conn *conn, uint16_t interval, uint16_t latency, uint16_t timeout)
+{
+	LOG_DBG("Conn params updated, interval %u latency %u timeout %u", interval, latency, timeout);
+	conn_policy_param_updated(conn, interval, latency);
+}
+
+#if defined(CONFIG_BT_USER_PHY_UPDATE)
+static void le_phy_updated_cb(struct bt_conn *conn, struct bt_conn_le_phy_info *param)
+{
+	LOG_INF("PHY updated, tx %u rx %u", param->tx_phy, param->rx_phy);
+	conn_policy_phy_updated(conn, param);
+}
+#endif
+
+static void att_mtu_updated_cb(struct bt_conn *conn, uint16_t tx, uint16_t rx)
+{
+	LOG_INF("ATT MTU updated, tx %u rx %u", tx, rx);
+	// larger batches are possible now
+	k_event_post(&main_evts, MAIN_EVT_BACKFILL);
 }
 
 static void pair_cancel(struct bt_conn *conn)
@@ -189,13 +703,13 @@ static void pairing_confirm(struct bt_conn *conn)
 static void passkey_display(struct bt_conn *conn, unsigned int passkey)
 {
 	LOG_DBG("Display passkey %u", passkey);
-	pair_passkey = passkey;
+	app.pair_passkey = passkey;
 }
 
 static void passkey_confirm(struct bt_conn *conn, unsigned int passkey)
 {
 	int err = 0;
-	if(passkey == pair_passkey){
+	if(passkey == app.pair_passkey){
 		LOG_DBG("Passkey confirm");
 		err = bt_conn_auth_passkey_confirm(conn);
 		if(err){
@@ -203,7 +717,7 @@ static void passkey_confirm(struct bt_conn *conn, unsigned int passkey)
 		}
 	}
 	else{
-		LOG_ERR("Passkey mismatch %u vs %u", pair_passkey, passkey);
+		LOG_ERR("Passkey mismatch %u vs %u", app.pair_passkey, passkey);
 		err = bt_conn_auth_cancel(conn);
 		if(err){
 			LOG_ERR("Cancel authentication error");
@@ -214,12 +728,13 @@ static void passkey_confirm(struct bt_conn *conn, unsigned int passkey)
 
 static void pairing_complete(struct bt_conn *conn, bool bonded)
 {
-	LOG_INF("Pairing complete");
+	LOG_INF("Pairing complete%s", bonded ? ", bonded" : "");
 }
 
 static void pairing_failed(struct bt_conn *conn, enum bt_security_err reason)
 {
 	LOG_ERR("Pairing fail, reason %d", reason);
+	metrics_inc(METRIC_PAIRING_FAILED);
 }
 
 static void bond_deleted(uint8_t id, const bt_addr_le_t *peer)
@@ -227,10 +742,9 @@ static void bond_deleted(uint8_t id, const bt_addr_le_t *peer)
 	LOG_DBG("Bond info deleted!");
 }
 
-static void sensor_timer_expiry_handler(struct k_timer *timer)
+static void sample_ready(void)
 {
-	// set timer expiry event
-	k_event_set(&main_evts, MAIN_EVT_TIMER_EXPIRY);
+	k_event_post(&main_evts, MAIN_EVT_SAMPLE);
 }
 
 static int ble_init()
@@ -242,7 +756,16 @@ static int ble_init()
 		return ret;
 	}
 
-	bt_conn_cb_register(&conn_callbacks);
+	if(IS_ENABLED(CONFIG_BT_SETTINGS)){
+		// bonds, before advertising builds the accept list from them
+		ret = settings_load();
+		if(ret){
+			LOG_WRN("Settings load error %d", ret);
+		}
+	}
+
+	conn_policy_init();
+	bt_gatt_cb_register(&gatt_callbacks);
 
 	ret = bt_conn_auth_cb_register(&conn_auth_callbacks);
 	if(ret){
@@ -263,7 +786,8 @@ static int ble_init()
 		return ret;
 	}
 
-	ret = bt_le_adv_start(BT_LE_ADV_CONN_NAME, adv_data, ARRAY_SIZE(adv_data), NULL, 0);
+	adv_init();
+	ret = adv_start();
 	if(ret){
 		LOG_ERR("Error starting advertising");
 		return ret;
@@ -274,50 +798,498 @@ static int ble_init()
 	return 0;
 }
 
-static int sht41_fetch_data()
+// Bytes of sample data that fit into one notification after the header
+static size_t tx_batch_size(struct bt_conn *conn)
 {
-	int ret = 0;
-	struct sensor_value t;
-	struct sensor_value rh;
-	ret = sensor_sample_fetch(sht41);
-	if(ret){
-		LOG_DBG("Sample fetch error");
-		return ret;
+	size_t payload = MIN((size_t)(bt_gatt_get_mtu(conn) - 3), TX_BUF_SIZE);
+
+	return (payload > TX_HDR_SIZE) ? (payload - TX_HDR_SIZE) : 0;
+}
+
+static void peer_reset_window(struct peer *peer)
+{
+	atomic_clear_bit(&peer->flags, PEER_FLAG_ACK);
+	atomic_clear(&peer->legacy_acks);
+	peer->send_seq = peer->tx_seq;
+	peer->batch_head = 0;
+	peer->in_flight = 0;
+}
+
+static size_t log_batch_records(struct bt_conn *conn)
+{
+	size_t payload = MIN((size_t)(bt_gatt_get_mtu(conn) - 3), TX_BUF_SIZE);
+
+	if(payload <= LOG_HDR_SIZE){
+		return 0;
 	}
 
-	ret = sensor_channel_get(sht41, SENSOR_CHAN_AMBIENT_TEMP, &t);
-	if(ret){
-		LOG_ERR("Error getting ambient temperature");
-		return ret;
+	return (payload - LOG_HDR_SIZE) / sizeof(struct sample_record);
+}
+
+static void peer_activate(struct peer *peer, struct bt_conn *conn)
+{
+	bt_addr_le_copy(&peer->addr, bt_conn_get_dst(conn));
+	peer->tx_seq = sample_buf_oldest_seq();
+	for(size_t i = 0; i < ARRAY_SIZE(peer_cursors); i++){
+		if(peer_cursors[i].used && !bt_addr_le_cmp(&peer_cursors[i].addr, &peer->addr)){
+			peer->tx_seq = peer_cursors[i].tx_seq;
+			metrics_inc(METRIC_RECONNECT);
+			break;
+		}
 	}
 
-	ret = sensor_channel_get(sht41, SENSOR_CHAN_HUMIDITY, &rh);
-	if(ret){
-		LOG_ERR("Error getting relative humidity");
-		return ret;
+	// client settings were reset in connected_cb(), they may already be written
+	atomic_clear_bit(&peer->flags, PEER_FLAG_RETRY);
+	atomic_clear_bit(&peer->flags, PEER_FLAG_LOG_BUSY);
+	peer->log_remaining = 0;
+	peer_reset_window(peer);
+	peer->retry_at = 0;
+	memset(&peer->retry, 0, sizeof(peer->retry));
+	peer->active = true;
+}
+
+static void peer_deactivate(struct peer *peer)
+{
+	struct peer_cursor *cursor = NULL;
+
+	for(size_t i = 0; i < ARRAY_SIZE(peer_cursors); i++){
+		if(peer_cursors[i].used && !bt_addr_le_cmp(&peer_cursors[i].addr, &peer->addr)){
+			cursor = &peer_cursors[i];
+			break;
+		}
 	}
 
-	sht41_sensor_data.temp = sensor_value_to_double(&t);
-	sht41_sensor_data.rh = sensor_value_to_double(&rh);
+	if(!cursor){
+		// replace the oldest entry
+		cursor = &peer_cursors[app.peer_cursor_next];
+		app.peer_cursor_next = (app.peer_cursor_next + 1) % ARRAY_SIZE(peer_cursors);
+	}
 
-	return 0;
+	cursor->used = true;
+	bt_addr_le_copy(&cursor->addr, &peer->addr);
+	cursor->tx_seq = peer->tx_seq;
+	peer->active = false;
 }
 
-static int sht41_init()
+/*
+ * Send the next batch of samples starting at the peer's send position, packing
+ * as many records into the notification as the ATT MTU allows. Returns the
+ * number of samples sent, 0 if everything was sent, or a negative error.
+ */
+static int peer_send(struct peer *peer, struct bt_conn *conn)
 {
-	if(!device_is_ready(sht41)){
-		LOG_ERR("%s device not ready", sht41->name);
-		return -ENODEV;
+	int res = 0;
+	uint32_t seq = peer->send_seq;
+	size_t count;
+	size_t len;
+	size_t size = tx_batch_size(conn);
+	uint32_t start;
+	bool delta = (atomic_get(&peer->encoding) == TX_ENCODING_DELTA);
+	size_t max_records = delta ? MIN(1 + (size - sizeof(struct sample_record)) / ENCODE_DELTA_MIN_SIZE, TX_MAX_DELTA_RECORDS) :
+		MIN(size / sizeof(struct sample_record), TX_MAX_RECORDS);
+
+	if(size < sizeof(struct sample_record)){
+		return -EMSGSIZE;
 	}
 
-	return 0;
+	count = sample_buf_read(&seq, tx_records, max_records);
+	if(seq != peer->send_seq){
+		metrics_add(METRIC_SAMPLE_OVERWRITTEN, seq - peer->send_seq);
+		LOG_WRN("%u buffered samples overwritten", seq - peer->send_seq);
+		peer->send_seq = seq;
+		if(!peer->in_flight){
+			peer->tx_seq = seq;
+		}
+	}
+
+	if(!count){
+		return 0;
+	}
+
+	if(delta){
+		// as many records as the encoding fits, the rest goes in the next notification
+		count = encode_delta(tx_records, count, &tx_buf[TX_HDR_SIZE], size, &len);
+	}
+	else{
+		len = count * sizeof(struct sample_record);
+		memcpy(&tx_buf[TX_HDR_SIZE], tx_records, len);
+	}
+
+	sys_put_le32(seq, &tx_buf[0]);
+	sys_put_le32((uint32_t)(k_uptime_get() / MSEC_PER_SEC), &tx_buf[sizeof(uint32_t)]);
+
+	start = wake_stats_start();
+	res = bt_gatt_notify(conn, TX_ATTR, tx_buf, TX_HDR_SIZE + len);
+	wake_stats_record(WAKE_STAT_NOTIFY, start);
+	if(res){
+		METRIC_WRN(METRIC_NOTIFY_ERROR, "Notify error %d", res);
+		return res;
+	}
+
+	metrics_add(METRIC_BYTES_SENT, TX_HDR_SIZE + len);
+	peer->send_seq += count;
+	return count;
+}
+
+static void peer_retry_later(struct peer *peer, struct bt_conn *conn, int64_t now, enum retry_reason reason)
+{
+	uint32_t delay = retry_delay_ms(&peer->retry, reason);
+
+	LOG_DBG("Peer %u retry in %u ms", bt_conn_index(conn), delay);
+	// go back to the oldest unacknowledged sample
+	peer_reset_window(peer);
+	peer->retry_at = now + delay;
+	// keep the link fast while retrying
+	conn_policy_burst_begin(conn);
+}
+
+static void peer_pop_batch(struct peer *peer)
+{
+	wake_stats_record(WAKE_STAT_ACK_WAIT, peer->batch_sent[peer->batch_head]);
+	metrics_inc(METRIC_ACK);
+	metrics_add(METRIC_ACK_RTT_MS, k_uptime_get_32() - peer->batch_sent_ms[peer->batch_head]);
+	peer->tx_seq = peer->batch_end[peer->batch_head];
+	peer->batch_head = (peer->batch_head + 1) % TX_WINDOW;
+	peer->in_flight--;
+}
+
+// Apply acks received since the last call, returns true if the window moved
+static bool peer_process_acks(struct peer *peer)
+{
+	bool progress = false;
+	uint32_t ack;
+	atomic_val_t legacy = atomic_clear(&peer->legacy_acks);
+
+	if(atomic_test_and_clear_bit(&peer->flags, PEER_FLAG_ACK)){
+		ack = (uint32_t)atomic_get(&peer->ack_seq);
+		// ignore acks outside what is in flight, e.g. after going back
+		if(ack - peer->tx_seq && ack - peer->tx_seq <= peer->send_seq - peer->tx_seq){
+			while(peer->in_flight && ack - peer->batch_end[peer->batch_head] < INT32_MAX){
+				peer_pop_batch(peer);
+			}
+			peer->tx_seq = ack;
+			progress = true;
+		}
+	}
+
+	while(legacy-- > 0 && peer->in_flight){
+		peer_pop_batch(peer);
+		progress = true;
+	}
+
+	return progress;
+}
+
+/*
+ * Advance one peer's transfer without blocking: apply acks, detect a timeout,
+ * and fill the window with new notifications. Up to CONFIG_APP_TX_WINDOW
+ * notifications may wait for an ack at the same time.
+ */
+static void peer_service(struct peer *peer, struct bt_conn *conn, int64_t now)
+{
+	int res = 0;
+	uint8_t slot;
+
+	if(!bt_gatt_is_subscribed(conn, TX_ATTR, BT_GATT_CCC_NOTIFY)){
+		peer_reset_window(peer);
+		peer->retry_at = 0;
+		conn_policy_burst_end(conn);
+		return;
+	}
+
+	if(atomic_test_and_clear_bit(&peer->flags, PEER_FLAG_RETRY)){
+		// the client is there to receive, go back and resend right away
+		peer_reset_window(peer);
+		peer->retry_at = 0;
+	}
+
+	if(peer_process_acks(peer)){
+		LOG_DBG("Peer %u acked up to %u, %u pending", bt_conn_index(conn), peer->tx_seq,
+			sample_buf_next_seq() - peer->tx_seq);
+		conn_policy_link_ok(conn);
+		retry_reset(&peer->retry, RETRY_ACK_TIMEOUT);
+		// the deadline runs from the last progress
+		peer->ack_deadline = now + RESP_TIMEOUT_SECONDS * MSEC_PER_SEC;
+	}
+
+	if(peer->in_flight && now >= peer->ack_deadline){
+		METRIC_WRN(METRIC_ACK_TIMEOUT, "BLE wait resp timeout");
+		conn_policy_link_error(conn);
+		peer_retry_later(peer, conn, now, RETRY_ACK_TIMEOUT);
+		return;
+	}
+
+	if(peer->retry_at){
+		if(now < peer->retry_at){
+			return;
+		}
+		peer->retry_at = 0;
+	}
+
+	while(peer->in_flight < TX_WINDOW){
+		res = peer_send(peer, conn);
+		if(res == 0){
+			break;
+		}
+
+		if(res < 0){
+			// out of buffers with notifications still in flight, continue on the next ack
+			if(res == -ENOMEM && peer->in_flight){
+				break;
+			}
+			conn_policy_link_error(conn);
+			peer_retry_later(peer, conn, now, RETRY_NOTIFY);
+			return;
+		}
+
+		retry_reset(&peer->retry, RETRY_NOTIFY);
+
+		if(!peer->in_flight){
+			peer->ack_deadline = now + RESP_TIMEOUT_SECONDS * MSEC_PER_SEC;
+		}
+
+		slot = (peer->batch_head + peer->in_flight) % TX_WINDOW;
+		peer->batch_end[slot] = peer->send_seq;
+		peer->batch_sent[slot] = wake_stats_start();
+		peer->batch_sent_ms[slot] = k_uptime_get_32();
+		peer->in_flight++;
+	}
+
+	// more queued than the window holds, speed up the connection until drained
+	if(sample_buf_next_seq() != peer->send_seq){
+		conn_policy_burst_begin(conn);
+	}
+	else if(!peer->in_flight){
+		conn_policy_burst_end(conn);
+	}
+}
+
+static void log_sent_cb(struct bt_conn *conn, void *user_data)
+{
+	struct peer *peer = user_data;
+
+	atomic_clear_bit(&peer->flags, PEER_FLAG_LOG_BUSY);
+	k_event_post(&main_evts, MAIN_EVT_BACKFILL);
+}
+
+/*
+ * Stream a requested range of the flash log on the LOG characteristic, one
+ * notification at a time. The range ends with a notification carrying no
+ * records. Log records are not acknowledged, a client that misses some asks
+ * for the range again.
+ */
+static void peer_service_log(struct peer *peer, struct bt_conn *conn)
+{
+	int res = 0;
+	int count = 0;
+	uint16_t boot = sample_log_boot();
+	size_t max_records;
+	uint32_t seq;
+	k_spinlock_key_t key;
+	struct bt_gatt_notify_params params = {
+		.attr = LOG_ATTR,
+		.data = tx_buf,
+		.func = log_sent_cb,
+		.user_data = peer
+	};
+
+	if(atomic_test_and_clear_bit(&peer->flags, PEER_FLAG_LOG_REQ)){
+		key = k_spin_lock(&peers_lock);
+		sample_log_cursor_init(&peer->log_cursor, peer->log_req_seq);
+		// one extra for the end marker
+		peer->log_remaining = peer->log_req_count + 1;
+		k_spin_unlock(&peers_lock, key);
+		LOG_INF("Peer %u requested %u log records from %u", bt_conn_index(conn), peer->log_remaining - 1,
+			peer->log_cursor.seq);
+	}
+
+	if(!peer->log_remaining || atomic_test_bit(&peer->flags, PEER_FLAG_LOG_BUSY)){
+		return;
+	}
+
+	if(!bt_gatt_is_subscribed(conn, LOG_ATTR, BT_GATT_CCC_NOTIFY)){
+		peer->log_remaining = 0;
+		return;
+	}
+
+	if(peer->log_remaining > 1){
+		max_records = MIN(log_batch_records(conn), peer->log_remaining - 1);
+		count = sample_log_read(&peer->log_cursor, (struct sample_record *)&tx_buf[LOG_HDR_SIZE], max_records, &boot);
+		if(count < 0){
+			METRIC_WRN(METRIC_LOG_ERROR, "Log read error %d", count);
+			count = 0;
+		}
+	}
+
+	if(count){
+		// the cursor may have skipped erased records
+		seq = peer->log_cursor.seq - count;
+		peer->log_remaining -= count;
+	}
+	else{
+		// nothing left to read, finish with the end marker
+		seq = peer->log_cursor.seq;
+		peer->log_remaining = 0;
+	}
+
+	sys_put_le32(seq, &tx_buf[0]);
+	sys_put_le16(boot, &tx_buf[sizeof(uint32_t)]);
+	params.len = LOG_HDR_SIZE + count * sizeof(struct sample_record);
+
+	atomic_set_bit(&peer->flags, PEER_FLAG_LOG_BUSY);
+	res = bt_gatt_notify_cb(conn, &params);
+	if(res){
+		METRIC_WRN(METRIC_NOTIFY_ERROR, "Log notify error %d", res);
+		atomic_clear_bit(&peer->flags, PEER_FLAG_LOG_BUSY);
+		peer->log_remaining = 0;
+		return;
+	}
+
+	metrics_add(METRIC_BYTES_SENT, params.len);
+}
+
+static void peers_service(void)
+{
+	struct bt_conn *conn;
+	struct peer *peer;
+	k_spinlock_key_t key;
+	int64_t now = k_uptime_get();
+
+	for(size_t i = 0; i < ARRAY_SIZE(peers); i++){
+		peer = &peers[i];
+		key = k_spin_lock(&peers_lock);
+		conn = peer->conn ? bt_conn_ref(peer->conn) : NULL;
+		k_spin_unlock(&peers_lock, key);
+
+		if(atomic_test_and_clear_bit(&peer->flags, PEER_FLAG_NEW) || !conn){
+			// new connection or the previous one is gone, remember where it stopped
+			if(peer->active){
+				peer_deactivate(peer);
+			}
+			if(conn){
+				peer_activate(peer, conn);
+			}
+		}
+
+		if(conn){
+			peer_service(peer, conn, now);
+			peer_service_log(peer, conn);
+			bt_conn_unref(conn);
+		}
+	}
+}
+
+// Time until the earliest ack timeout or retry of any peer
+static k_timeout_t peers_next_wakeup(void)
+{
+	int64_t now = k_uptime_get();
+	int64_t next = INT64_MAX;
+
+	for(size_t i = 0; i < ARRAY_SIZE(peers); i++){
+		if(!peers[i].active){
+			continue;
+		}
+
+		if(peers[i].in_flight){
+			next = MIN(next, peers[i].ack_deadline);
+		}
+		else if(peers[i].retry_at){
+			next = MIN(next, peers[i].retry_at);
+		}
+	}
+
+	if(next == INT64_MAX){
+		return K_FOREVER;
+	}
+
+	return (next > now) ? K_MSEC(next - now) : K_NO_WAIT;
+}
+
+// Queue a sample for transmission if send is set, and log it
+static void store_sample(const struct sample_record *record, bool send)
+{
+	int res = 0;
+
+	if(send){
+		sample_buf_put(record);
+	}
+	else{
+		LOG_DBG("Sample within deadband");
+	}
+
+	res = sample_log_append(record);
+	if(res && res != -ENOTSUP){
+		METRIC_WRN(METRIC_LOG_ERROR, "Sample log append error %d", res);
+	}
+}
+
+// Queue a sample for transmission unless it is within the deadband, and log it
+static void report_sample(const struct sample_record *record, bool force)
+{
+	store_sample(record, force || report_filter_accept(record));
+}
+
+#if defined(CONFIG_APP_AGGREGATE)
+// Fold a sample into the window and report the summary once the window is over
+static void aggregate_sample(const struct sample_record *record)
+{
+	struct sample_record summary[AGGREGATE_MAX_RECORDS];
+	size_t count;
+	bool send;
+	int64_t now = k_uptime_get();
+
+	if(!aggregate_count()){
+		if(app.slot_period_s){
+			// close on the next slot start, samples run on the slot so one lands there
+			app.window_end = slot_next_ms(now + 1) - sample_period_ms() / 2;
+		}
+		else{
+			app.window_end = now + (int64_t)app.sample_interval_s * MSEC_PER_SEC;
+		}
+	}
+
+	aggregate_add(record);
+	if(now < app.window_end && aggregate_count() < UINT16_MAX){
+		return;
+	}
+
+	count = aggregate_finish(record->timestamp, summary);
+	if(!count){
+		return;
+	}
+
+	// a window is sent whole, always when it has extremes (already past the deadband)
+	send = report_filter_accept(&summary[count - 1]) || count > AGGREGATE_MIN_RECORDS;
+	for(size_t i = 0; i < count; i++){
+		store_sample(&summary[i], send);
+	}
+}
+#endif
+
+static void bench_sent_cb(struct bt_conn *conn, void *user_data)
+{
+	bench_sent();
+}
+
+static int bench_send(const uint8_t *buf, uint16_t len)
+{
+	struct bt_gatt_notify_params params = {
+		.attr = TX_ATTR,
+		.data = buf,
+		.len = len,
+		.func = bench_sent_cb
+	};
+
+	// to the subscribed client, bench_run() waits for one
+	return bt_gatt_notify_cb(NULL, &params);
 }
 
 void main(void)
 {
 	int res = 0;
 	uint32_t event;
-	int16_t notify_buffer[2];
+	uint32_t wake;
+	struct sampler_msg msg;
 	if(ble_init()){
 		return;
 	}
@@ -326,41 +1298,53 @@ void main(void)
 		// return;
 	}
 
+	res = sample_log_init();
+	if(res && res != -ENOTSUP){
+		LOG_ERR("Sample log init error %d", res);
+	}
+
+	res = log_chan_init();
+	if(res && res != -ENOTSUP){
+		LOG_ERR("Log channel init error %d", res);
+	}
+
+	bench_run(bench_send);
+
+	// sample continuously, readings are buffered until a client collects them
+	sampler_init(sample_ready);
+	sampler_start(sample_period_ms());
+
 	while(1){
-		event = k_event_wait(&main_evts, MAIN_EVT_TIMER_EXPIRY, true, K_FOREVER);
-		if(!(event & MAIN_EVT_TIMER_EXPIRY)){
-			LOG_WRN("Unexpected event %d", event);
-			continue;
-		}
+		event = k_event_wait(&main_evts, MAIN_EVT_SAMPLE | MAIN_EVT_BLE_RESP_RECEIVED | MAIN_EVT_BACKFILL |
+			MAIN_EVT_SCHEDULE, false, peers_next_wakeup());
+		k_event_clear(&main_evts, event);
+		wake = wake_stats_start();
 
-		res = sht41_fetch_data();
-		if(res){
-			LOG_ERR("Error %d fetching sensor data", res);
-			// restart timer with shorter duration
-			k_timer_start(&sensor_timer, K_SECONDS(15), K_SECONDS(15));
-			continue;
+		if(event & MAIN_EVT_SCHEDULE){
+			schedule_apply();
 		}
 
-		if(notifications_enabled){
-			notify_buffer[0] = (int16_t)(sht41_sensor_data.temp * 100);
-			notify_buffer[1] = (int16_t)(sht41_sensor_data.rh * 100);
+		while(!sampler_get(&msg)){
+			metrics_inc(METRIC_SAMPLE);
+			adv_update_reading(&msg.record);
 
-			res = bt_gatt_notify(conn, &primary_service.attrs[3], (const void *)notify_buffer, sizeof(notify_buffer));
-			if(res){
-				LOG_WRN("Notify error %d", res);
-				k_timer_start(&sensor_timer, K_SECONDS(15), K_SECONDS(15));				
-				continue;
+			// explicit reads are always reported
+			if(msg.forced){
+				report_sample(&msg.record, true);
+			}
+			else{
+#if defined(CONFIG_APP_AGGREGATE)
+				aggregate_sample(&msg.record);
+#else
+				report_sample(&msg.record, false);
+#endif
 			}
 		}
 
-		event = k_event_wait(&main_evts, MAIN_EVT_BLE_RESP_RECEIVED, true, K_SECONDS(5));
-		if(!(event & MAIN_EVT_BLE_RESP_RECEIVED)){
-			LOG_WRN("BLE wait resp timeout");
-			k_timer_start(&sensor_timer, K_SECONDS(15), K_SECONDS(15));
-			continue;
-		}
+		peers_service();
 
-		// reset timer
-		k_timer_start(&sensor_timer, K_MINUTES(TIMER_INTERVAL_MINUTES), K_MINUTES(TIMER_INTERVAL_MINUTES));
+		// no event means a peer deadline woke the loop
+		wake_stats_record((event & MAIN_EVT_SAMPLE) ? WAKE_STAT_WAKE_SAMPLE :
+			(event ? WAKE_STAT_WAKE_BLE_RX : WAKE_STAT_WAKE_RETRY), wake);
 	}
 }
@@ -0,0 +1,35 @@
+/* metrics.c - Binary event counters */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+
+#include "metrics.h"
+
+static atomic_t counters[METRIC_COUNT];
+
+void metrics_add(enum metric metric, uint32_t n)
+{
+	atomic_add(&counters[metric], (atomic_val_t)n);
+}
+
+uint32_t metrics_get(enum metric metric)
+{
+	return (uint32_t)atomic_get(&counters[metric]);
+}
+
+bool metrics_log_allowed(int64_t *last)
+{
+	int64_t now = k_uptime_get();
+
+	// the first occurrence is always logged
+	if(*last && now - *last < CONFIG_APP_LOG_RATELIMIT_MS){
+		return false;
+	}
+
+	*last = now ? now : 1;
+	return true;
+}
@@ -0,0 +1,65 @@
+/* metrics.h - Binary event counters */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdbool.h>
+#include <zephyr/types.h>
+#include <zephyr/logging/log.h>
+
+/*
+ * Failures worth knowing about in the field are counted here instead of
+ * relying on log output, which production builds mostly compile out, along
+ * with the activity needed to put them in proportion. The counters start at
+ * zero on every boot and are read from the metrics characteristic.
+ */
+
+enum metric{
+	METRIC_FETCH_ERROR,			// sensor read failed
+	METRIC_READING_DROPPED,		// sampler queue full
+	METRIC_SAMPLE_OVERWRITTEN,	// sample left the ring buffer before it was sent
+	METRIC_NOTIFY_ERROR,
+	METRIC_ACK_TIMEOUT,
+	METRIC_LOG_ERROR,			// flash log append or read failed
+	METRIC_ADV_ERROR,
+	METRIC_DISCONNECT,
+	METRIC_PAIRING_FAILED,
+	METRIC_SAMPLE,				// reading handed to the BLE side
+	METRIC_BYTES_SENT,			// notification payload, samples and log
+	METRIC_ACK,					// sample notifications acknowledged
+	METRIC_ACK_RTT_MS,			// sum of their send to ack times
+	METRIC_CONNECT,
+	METRIC_RECONNECT,			// connection from a peer with a remembered cursor
+	METRIC_COUNT
+};
+
+void metrics_add(enum metric metric, uint32_t n);
+uint32_t metrics_get(enum metric metric);
+
+static inline void metrics_inc(enum metric metric)
+{
+	metrics_add(metric, 1);
+}
+
+// True if at least CONFIG_APP_LOG_RATELIMIT_MS passed since *last, updates *last
+bool metrics_log_allowed(int64_t *last);
+
+/*
+ * Count the event and log a warning for it, at most once every
+ * CONFIG_APP_LOG_RATELIMIT_MS per call site so a failing link does not flood
+ * the log.
+ */
+#define METRIC_WRN(metric, ...)							\
+	do {												\
+		static int64_t metric_last_log_;				\
+		metrics_inc(metric);							\
+		if(metrics_log_allowed(&metric_last_log_)){	\
+			LOG_WRN(__VA_ARGS__);						\
+		}												\
+	} while(0)
+
+#endif /* METRICS_H_ */
@@ -0,0 +1,65 @@
+/* report_filter.c - Report on change deadband filter */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/spinlock.h>
+#include <stdlib.h>
+
+#include "report_filter.h"
+
+static uint16_t temp_deadband = CONFIG_APP_REPORT_TEMP_DEADBAND;
+static uint16_t rh_deadband = CONFIG_APP_REPORT_RH_DEADBAND;
+static uint8_t max_skip = CONFIG_APP_REPORT_MAX_SKIP;
+
+static struct sample_record last_reported;
+static bool last_valid;
+static uint8_t skipped;
+static struct k_spinlock lock;
+
+void report_filter_set(uint16_t temp, uint16_t rh, uint8_t skip)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	temp_deadband = temp;
+	rh_deadband = rh;
+	max_skip = skip;
+
+	k_spin_unlock(&lock, key);
+}
+
+bool report_filter_accept(const struct sample_record *rec)
+{
+	bool accept;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	accept = !last_valid || skipped >= max_skip ||
+		abs(rec->temp - last_reported.temp) > temp_deadband ||
+		abs(sample_rh(rec) - sample_rh(&last_reported)) > rh_deadband;
+
+	if(accept){
+		last_reported = *rec;
+		last_valid = true;
+		skipped = 0;
+	}
+	else{
+		skipped++;
+	}
+
+	k_spin_unlock(&lock, key);
+	return accept;
+}
+
+bool report_filter_within(const struct sample_record *rec, const struct sample_record *ref)
+{
+	bool within;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	within = abs(rec->temp - ref->temp) <= temp_deadband &&
+		abs(sample_rh(rec) - sample_rh(ref)) <= rh_deadband;
+
+	k_spin_unlock(&lock, key);
+	return within;
+}
@@ -0,0 +1,30 @@
+/* report_filter.h - Report on change deadband filter */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef REPORT_FILTER_H_
+#define REPORT_FILTER_H_
+
+#include <stdbool.h>
+#include <zephyr/types.h>
+
+#include "sample.h"
+
+/*
+ * A sample is only queued for transmission when temperature or humidity moved
+ * by more than the deadband since the last reported sample, or when
+ * max_skip samples in a row were suppressed (heartbeat). A deadband of 0
+ * reports every sample.
+ */
+
+void report_filter_set(uint16_t temp_deadband, uint16_t rh_deadband, uint8_t max_skip);
+
+// Returns true if the sample should be reported
+bool report_filter_accept(const struct sample_record *rec);
+
+// True if rec is within the current deadband of ref
+bool report_filter_within(const struct sample_record *rec, const struct sample_record *ref);
+
+#endif /* REPORT_FILTER_H_ */
@@ -0,0 +1,46 @@
+/* retry.c - Retry backoff scheduler */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/random/rand32.h>
+#include <zephyr/sys/atomic.h>
+
+#include "retry.h"
+
+BUILD_ASSERT(CONFIG_APP_RETRY_BASE_S <= CONFIG_APP_RETRY_MAX_S);
+
+static atomic_t counts[RETRY_REASON_COUNT];
+
+uint32_t retry_delay_ms(struct retry_state *state, enum retry_reason reason)
+{
+	uint32_t delay = CONFIG_APP_RETRY_MAX_S * MSEC_PER_SEC;
+	uint32_t jitter;
+	uint8_t attempts = state->attempts[reason];
+
+	// stop doubling once the cap is reached so the shift cannot overflow
+	if((CONFIG_APP_RETRY_BASE_S << attempts) < CONFIG_APP_RETRY_MAX_S){
+		delay = (CONFIG_APP_RETRY_BASE_S << attempts) * MSEC_PER_SEC;
+		state->attempts[reason]++;
+	}
+
+	jitter = delay / 100 * CONFIG_APP_RETRY_JITTER_PCT;
+	if(jitter){
+		delay -= sys_rand32_get() % (jitter + 1);
+	}
+
+	atomic_inc(&counts[reason]);
+	return delay;
+}
+
+void retry_reset(struct retry_state *state, enum retry_reason reason)
+{
+	state->attempts[reason] = 0;
+}
+
+uint32_t retry_count(enum retry_reason reason)
+{
+	return (uint32_t)atomic_get(&counts[reason]);
+}
@@ -0,0 +1,40 @@
+/* retry.h - Retry backoff scheduler */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef RETRY_H_
+#define RETRY_H_
+
+#include <zephyr/types.h>
+
+/*
+ * Failed operations are retried after an exponential backoff: the first retry
+ * waits CONFIG_APP_RETRY_BASE_S, every further one twice as long up to
+ * CONFIG_APP_RETRY_MAX_S. A random part of CONFIG_APP_RETRY_JITTER_PCT percent
+ * is taken off each delay so nodes that failed together (e.g. when a gateway
+ * went down) do not retry in lockstep. Every reason backs off on its own.
+ */
+
+enum retry_reason{
+	RETRY_FETCH,		// sensor read failed
+	RETRY_NOTIFY,		// notification could not be queued
+	RETRY_ACK_TIMEOUT,	// notification not acknowledged in time
+	RETRY_REASON_COUNT
+};
+
+struct retry_state{
+	uint8_t attempts[RETRY_REASON_COUNT];
+};
+
+// Returns the delay before the next attempt and counts the failure
+uint32_t retry_delay_ms(struct retry_state *state, enum retry_reason reason);
+
+// The operation succeeded, the next failure starts from the base delay again
+void retry_reset(struct retry_state *state, enum retry_reason reason);
+
+// Total number of retries scheduled for the reason since boot
+uint32_t retry_count(enum retry_reason reason);
+
+#endif /* RETRY_H_ */
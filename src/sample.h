@@ -0,0 +1,53 @@
+/* sample.h - Compact sensor sample record */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef SAMPLE_H_
+#define SAMPLE_H_
+
+#include <zephyr/types.h>
+#include <zephyr/toolchain.h>
+
+// One sensor reading as stored and sent on air (little endian)
+struct sample_record{
+	uint32_t timestamp;	// seconds since boot, Unix time once synced (see timesync.h)
+	int16_t temp;		// centi-degrees Celsius
+	uint16_t rh;		// centi-percent relative humidity, kind in the top bits
+} __packed;
+
+/*
+ * Humidity never exceeds 10000, so the top two bits of rh tell the records of
+ * an aggregation window summary apart from plain readings. A summary is a
+ * SAMPLE_KIND_WINDOW record stamped with the window start whose temp field
+ * holds the number of samples (as uint16) and rh the kind only, then the
+ * SAMPLE_KIND_EXTREME records by time, then the SAMPLE_KIND_MEAN record
+ * stamped with the window end.
+ */
+#define SAMPLE_RH_MASK			0x3fff
+#define SAMPLE_KIND_SHIFT		14
+
+enum sample_kind{
+	SAMPLE_KIND_READING = 0,
+	SAMPLE_KIND_WINDOW = 1,
+	SAMPLE_KIND_EXTREME = 2,
+	SAMPLE_KIND_MEAN = 3
+};
+
+static inline uint16_t sample_rh(const struct sample_record *rec)
+{
+	return rec->rh & SAMPLE_RH_MASK;
+}
+
+static inline enum sample_kind sample_kind(const struct sample_record *rec)
+{
+	return (enum sample_kind)(rec->rh >> SAMPLE_KIND_SHIFT);
+}
+
+static inline void sample_set_kind(struct sample_record *rec, enum sample_kind kind)
+{
+	rec->rh = sample_rh(rec) | (uint16_t)(kind << SAMPLE_KIND_SHIFT);
+}
+
+#endif /* SAMPLE_H_ */
@@ -0,0 +1,72 @@
+/* sample_buf.c - RAM ring buffer of samples awaiting transmission */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/util.h>
+
+#include "sample_buf.h"
+
+#define SAMPLE_BUF_SIZE		CONFIG_APP_SAMPLE_BUF_SIZE
+
+static struct sample_record records[SAMPLE_BUF_SIZE];
+static uint32_t head_seq;
+static struct k_spinlock lock;
+
+static uint32_t oldest_seq_locked(void)
+{
+	return (head_seq > SAMPLE_BUF_SIZE) ? (head_seq - SAMPLE_BUF_SIZE) : 0;
+}
+
+void sample_buf_put(const struct sample_record *rec)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	records[head_seq % SAMPLE_BUF_SIZE] = *rec;
+	head_seq++;
+
+	k_spin_unlock(&lock, key);
+}
+
+uint32_t sample_buf_next_seq(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	uint32_t seq = head_seq;
+
+	k_spin_unlock(&lock, key);
+	return seq;
+}
+
+uint32_t sample_buf_oldest_seq(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	uint32_t seq = oldest_seq_locked();
+
+	k_spin_unlock(&lock, key);
+	return seq;
+}
+
+size_t sample_buf_read(uint32_t *seq, struct sample_record *out, size_t max)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	uint32_t oldest = oldest_seq_locked();
+	size_t count;
+
+	if(*seq < oldest){
+		*seq = oldest;
+	}
+	else if(*seq > head_seq){
+		*seq = head_seq;
+	}
+
+	count = MIN(head_seq - *seq, max);
+	for(size_t i = 0; i < count; i++){
+		out[i] = records[(*seq + i) % SAMPLE_BUF_SIZE];
+	}
+
+	k_spin_unlock(&lock, key);
+	return count;
+}
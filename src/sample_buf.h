@@ -0,0 +1,37 @@
+/* sample_buf.h - RAM ring buffer of samples awaiting transmission */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef SAMPLE_BUF_H_
+#define SAMPLE_BUF_H_
+
+#include <stddef.h>
+#include <zephyr/types.h>
+
+#include "sample.h"
+
+/*
+ * Every record put into the buffer gets a monotonically increasing sequence
+ * number. Consumers keep their own cursor (the next sequence number they want)
+ * so records are never removed on read; once the buffer is full the oldest
+ * record is overwritten.
+ */
+
+void sample_buf_put(const struct sample_record *rec);
+
+// Sequence number the next record will get
+uint32_t sample_buf_next_seq(void);
+
+// Sequence number of the oldest record still held
+uint32_t sample_buf_oldest_seq(void);
+
+/*
+ * Copy up to max records starting at *seq into out. If *seq refers to records
+ * that were already overwritten it is moved forward to the oldest one held.
+ * Returns the number of records copied.
+ */
+size_t sample_buf_read(uint32_t *seq, struct sample_record *out, size_t max);
+
+#endif /* SAMPLE_BUF_H_ */
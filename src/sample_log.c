@@ -0,0 +1,369 @@
+/* sample_log.c - Flash backed persistent sample log */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/fs/fcb.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/logging/log.h>
+#include <string.h>
+
+#include "sample_log.h"
+
+LOG_MODULE_REGISTER(SAMPLE_LOG, CONFIG_APP_SAMPLE_LOG_LOG_LEVEL);
+
+#define SAMPLE_LOG_AREA_ID			DT_FIXED_PARTITION_ID(DT_NODELABEL(log_partition))
+#define SAMPLE_LOG_MAGIC			0x53483431	// "SH41"
+#define SAMPLE_LOG_VERSION			1
+#define BLOCK_SAMPLES				CONFIG_APP_SAMPLE_LOG_BLOCK_SAMPLES
+
+// Keep blocks a multiple of the flash write unit without padding
+BUILD_ASSERT(sizeof(struct sample_log_block_hdr) % 4 == 0);
+BUILD_ASSERT(sizeof(struct sample_record) % 4 == 0);
+
+static struct flash_sector log_sectors[CONFIG_APP_SAMPLE_LOG_MAX_SECTORS];
+static struct fcb log_fcb;
+static bool log_ready;
+
+// Incremented whenever a sector is erased, invalidates cached cursor locations
+static uint32_t log_gen;
+static uint32_t oldest_seq;
+// Sequence number of the next record appended, staged records included
+static uint32_t next_seq;
+static uint16_t boot;
+
+// Block being filled in RAM, written to flash in one go once full
+static struct {
+	struct sample_log_block_hdr hdr;
+	struct sample_record records[BLOCK_SAMPLES];
+} __packed __aligned(4) staging;
+
+K_MUTEX_DEFINE(log_lock);
+
+static void flush_work_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(flush_work, flush_work_handler);
+
+static int read_hdr(struct fcb_entry *loc, struct sample_log_block_hdr *hdr)
+{
+	int ret = 0;
+
+	if(loc->fe_data_len < sizeof(*hdr)){
+		return -EINVAL;
+	}
+
+	ret = flash_area_read(log_fcb.fap, FCB_ENTRY_FA_DATA_OFF(*loc), hdr, sizeof(*hdr));
+	if(ret){
+		return ret;
+	}
+
+	if(loc->fe_data_len < sizeof(*hdr) + hdr->count * sizeof(struct sample_record)){
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void update_oldest_locked(void)
+{
+	struct fcb_entry loc = {0};
+	struct sample_log_block_hdr hdr;
+
+	while(!fcb_getnext(&log_fcb, &loc)){
+		if(!read_hdr(&loc, &hdr)){
+			oldest_seq = hdr.first_seq;
+			return;
+		}
+	}
+
+	oldest_seq = staging.hdr.first_seq;
+}
+
+static int flush_locked(void)
+{
+	int ret = 0;
+	struct fcb_entry loc;
+	bool rotated = false;
+	uint16_t len = sizeof(staging.hdr) + staging.hdr.count * sizeof(struct sample_record);
+
+	if(!staging.hdr.count){
+		return 0;
+	}
+
+	ret = fcb_append(&log_fcb, len, &loc);
+	if(ret == -ENOSPC){
+		// log full, drop the oldest sector
+		ret = fcb_rotate(&log_fcb);
+		if(ret){
+			LOG_ERR("Rotate error %d", ret);
+			goto out;
+		}
+
+		log_gen++;
+		rotated = true;
+		ret = fcb_append(&log_fcb, len, &loc);
+	}
+	if(ret){
+		LOG_ERR("Append error %d", ret);
+		goto out;
+	}
+
+	ret = flash_area_write(log_fcb.fap, FCB_ENTRY_FA_DATA_OFF(loc), &staging, len);
+	if(ret){
+		LOG_ERR("Write error %d", ret);
+		goto out;
+	}
+
+	ret = fcb_append_finish(&log_fcb, &loc);
+	if(ret){
+		LOG_ERR("Append finish error %d", ret);
+	}
+
+out:
+	// on failure the block is dropped rather than retried, leaving a gap in the sequence
+	staging.hdr.first_seq = next_seq;
+	staging.hdr.count = 0;
+	if(rotated){
+		update_oldest_locked();
+	}
+
+	return ret;
+}
+
+int sample_log_init(void)
+{
+	int ret = 0;
+	uint32_t sector_cnt = ARRAY_SIZE(log_sectors);
+	struct fcb_entry loc = {0};
+	struct sample_log_block_hdr hdr;
+	bool found = false;
+	const struct flash_area *fap;
+
+	ret = flash_area_get_sectors(SAMPLE_LOG_AREA_ID, &sector_cnt, log_sectors);
+	if(ret){
+		LOG_ERR("Get flash sectors error %d", ret);
+		return ret;
+	}
+
+	log_fcb.f_magic = SAMPLE_LOG_MAGIC;
+	log_fcb.f_version = SAMPLE_LOG_VERSION;
+	log_fcb.f_sector_cnt = sector_cnt;
+	log_fcb.f_scratch_cnt = 0;
+	log_fcb.f_sectors = log_sectors;
+
+	ret = fcb_init(SAMPLE_LOG_AREA_ID, &log_fcb);
+	if(ret){
+		// unknown content, start over with an empty log
+		LOG_WRN("Log init error %d, erasing", ret);
+		ret = flash_area_open(SAMPLE_LOG_AREA_ID, &fap);
+		if(ret){
+			return ret;
+		}
+
+		ret = flash_area_erase(fap, 0, fap->fa_size);
+		flash_area_close(fap);
+		if(ret){
+			LOG_ERR("Erase error %d", ret);
+			return ret;
+		}
+
+		ret = fcb_init(SAMPLE_LOG_AREA_ID, &log_fcb);
+		if(ret){
+			LOG_ERR("Log init error %d", ret);
+			return ret;
+		}
+	}
+
+	k_mutex_lock(&log_lock, K_FOREVER);
+
+	// find where the previous boot stopped
+	while(!fcb_getnext(&log_fcb, &loc)){
+		if(read_hdr(&loc, &hdr)){
+			continue;
+		}
+
+		if(!found){
+			oldest_seq = hdr.first_seq;
+			found = true;
+		}
+
+		next_seq = hdr.first_seq + hdr.count;
+		boot = hdr.boot;
+	}
+
+	if(found){
+		boot++;
+	}
+	else{
+		oldest_seq = next_seq;
+	}
+
+	staging.hdr.first_seq = next_seq;
+	staging.hdr.boot = boot;
+	staging.hdr.count = 0;
+	log_ready = true;
+
+	k_mutex_unlock(&log_lock);
+
+	LOG_INF("Sample log ready, seq %u..%u, boot %u", oldest_seq, next_seq, boot);
+
+	return 0;
+}
+
+int sample_log_append(const struct sample_record *rec)
+{
+	int ret = 0;
+
+	if(!log_ready){
+		return -ENODEV;
+	}
+
+	k_mutex_lock(&log_lock, K_FOREVER);
+
+	staging.records[staging.hdr.count++] = *rec;
+	next_seq++;
+	if(staging.hdr.count >= BLOCK_SAMPLES){
+		ret = flush_locked();
+	}
+	else if(staging.hdr.count == 1 && CONFIG_APP_SAMPLE_LOG_FLUSH_S){
+		// bound the time the block is only in RAM
+		k_work_schedule(&flush_work, K_SECONDS(CONFIG_APP_SAMPLE_LOG_FLUSH_S));
+	}
+
+	k_mutex_unlock(&log_lock);
+
+	return ret;
+}
+
+int sample_log_flush(void)
+{
+	int ret = 0;
+
+	if(!log_ready){
+		return -ENODEV;
+	}
+
+	k_mutex_lock(&log_lock, K_FOREVER);
+	ret = flush_locked();
+	k_mutex_unlock(&log_lock);
+
+	return ret;
+}
+
+static void flush_work_handler(struct k_work *work)
+{
+	// errors are logged by flush_locked()
+	sample_log_flush();
+}
+
+void sample_log_flush_async(void)
+{
+	k_work_reschedule(&flush_work, K_NO_WAIT);
+}
+
+uint32_t sample_log_next_seq(void)
+{
+	return next_seq;
+}
+
+uint32_t sample_log_oldest_seq(void)
+{
+	return oldest_seq;
+}
+
+uint16_t sample_log_boot(void)
+{
+	return boot;
+}
+
+void sample_log_cursor_init(struct sample_log_cursor *cursor, uint32_t seq)
+{
+	memset(cursor, 0, sizeof(*cursor));
+	cursor->seq = seq;
+}
+
+int sample_log_read(struct sample_log_cursor *cursor, struct sample_record *out, size_t max, uint16_t *boot)
+{
+	int ret = 0;
+	size_t n = 0;
+	size_t idx;
+	size_t cnt;
+	struct sample_log_block_hdr hdr;
+	struct fcb_entry prev;
+
+	if(!log_ready){
+		return -ENODEV;
+	}
+
+	k_mutex_lock(&log_lock, K_FOREVER);
+
+	if(cursor->gen != log_gen){
+		// cached block may have been erased, search from the start
+		cursor->loc.fe_sector = NULL;
+		cursor->loc.fe_elem_off = 0;
+		cursor->gen = log_gen;
+	}
+
+	if(cursor->seq < oldest_seq){
+		cursor->seq = oldest_seq;
+	}
+
+	// records already written to flash
+	while(n < max && cursor->seq < staging.hdr.first_seq){
+		if(!cursor->loc.fe_sector || read_hdr(&cursor->loc, &hdr) || cursor->seq >= hdr.first_seq + hdr.count){
+			prev = cursor->loc;
+			if(fcb_getnext(&log_fcb, &cursor->loc)){
+				// nothing more in flash, continue with the staged block
+				cursor->loc = prev;
+				cursor->seq = staging.hdr.first_seq;
+				break;
+			}
+			continue;
+		}
+
+		if(n && hdr.boot != *boot){
+			break;
+		}
+
+		if(cursor->seq < hdr.first_seq){
+			// skip a block that failed to write
+			cursor->seq = hdr.first_seq;
+		}
+
+		*boot = hdr.boot;
+
+		idx = cursor->seq - hdr.first_seq;
+		cnt = MIN(hdr.count - idx, max - n);
+		ret = flash_area_read(log_fcb.fap, FCB_ENTRY_FA_DATA_OFF(cursor->loc) + sizeof(hdr) + idx * sizeof(struct sample_record),
+			&out[n], cnt * sizeof(struct sample_record));
+		if(ret){
+			LOG_ERR("Read error %d", ret);
+			goto out;
+		}
+
+		n += cnt;
+		cursor->seq += cnt;
+	}
+
+	// records still staged in RAM
+	if(n < max && cursor->seq >= staging.hdr.first_seq && (!n || *boot == staging.hdr.boot)){
+		idx = cursor->seq - staging.hdr.first_seq;
+		if(idx < staging.hdr.count){
+			*boot = staging.hdr.boot;
+			cnt = MIN(staging.hdr.count - idx, max - n);
+			memcpy(&out[n], &staging.records[idx], cnt * sizeof(struct sample_record));
+			n += cnt;
+			cursor->seq += cnt;
+		}
+	}
+
+	ret = n;
+
+out:
+	k_mutex_unlock(&log_lock);
+	return ret;
+}
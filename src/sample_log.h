@@ -0,0 +1,114 @@
+/* sample_log.h - Flash backed persistent sample log */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef SAMPLE_LOG_H_
+#define SAMPLE_LOG_H_
+
+#include <stddef.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <zephyr/types.h>
+#include <zephyr/fs/fcb.h>
+
+#include "sample.h"
+
+/*
+ * Samples are staged in RAM and appended to a flash circular buffer (FCB) one
+ * block of CONFIG_APP_SAMPLE_LOG_BLOCK_SAMPLES records at a time. When the log
+ * is full the oldest flash sector is erased. Like the RAM buffer, every record
+ * has a sequence number; unlike it, the numbering survives resets.
+ */
+
+// Header stored in front of every block in flash
+struct sample_log_block_hdr{
+	uint32_t first_seq;	// sequence number of the first record in the block
+	uint16_t boot;		// boot counter, record timestamps are relative to it
+	uint16_t count;		// number of records following the header
+} __packed;
+
+// Read position, owned by the reader
+struct sample_log_cursor{
+	uint32_t seq;			// next sequence number to read
+	struct fcb_entry loc;	// cached flash block holding seq
+	uint32_t gen;			// log generation loc is valid for
+};
+
+#if defined(CONFIG_APP_SAMPLE_LOG)
+
+int sample_log_init(void);
+
+// Stage a record, writing the staged block to flash once it is full
+int sample_log_append(const struct sample_record *rec);
+
+// Write the staged block to flash even if it is not full
+int sample_log_flush(void);
+
+// Same as sample_log_flush() from the system work queue, safe in callbacks
+void sample_log_flush_async(void);
+
+uint32_t sample_log_next_seq(void);
+uint32_t sample_log_oldest_seq(void);
+uint16_t sample_log_boot(void);
+
+void sample_log_cursor_init(struct sample_log_cursor *cursor, uint32_t seq);
+
+/*
+ * Read up to max records from the cursor position and advance it. Records
+ * already erased are skipped. A read never spans two boots, the boot the
+ * records belong to is stored in *boot. Returns the number of records read or
+ * a negative error.
+ */
+int sample_log_read(struct sample_log_cursor *cursor, struct sample_record *out, size_t max, uint16_t *boot);
+
+#else
+
+static inline int sample_log_init(void)
+{
+	return -ENOTSUP;
+}
+
+static inline int sample_log_append(const struct sample_record *rec)
+{
+	return -ENOTSUP;
+}
+
+static inline int sample_log_flush(void)
+{
+	return -ENOTSUP;
+}
+
+static inline void sample_log_flush_async(void)
+{
+}
+
+static inline uint32_t sample_log_next_seq(void)
+{
+	return 0;
+}
+
+static inline uint32_t sample_log_oldest_seq(void)
+{
+	return 0;
+}
+
+static inline uint16_t sample_log_boot(void)
+{
+	return 0;
+}
+
+static inline void sample_log_cursor_init(struct sample_log_cursor *cursor, uint32_t seq)
+{
+	cursor->seq = seq;
+}
+
+static inline int sample_log_read(struct sample_log_cursor *cursor, struct sample_record *out, size_t max, uint16_t *boot)
+{
+	return -ENOTSUP;
+}
+
+#endif
+
+#endif /* SAMPLE_LOG_H_ */
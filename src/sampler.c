@@ -0,0 +1,224 @@
+/* sampler.c - Sensor sampling stage */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+
+#include "metrics.h"
+#include "retry.h"
+#include "sampler.h"
+#include "sht41.h"
+#include "timesync.h"
+#include "wake_stats.h"
+
+LOG_MODULE_REGISTER(SAMPLER, CONFIG_APP_SAMPLER_LOG_LEVEL);
+
+static void sensor_timer_expiry_handler(struct k_timer *timer);
+
+K_THREAD_STACK_DEFINE(sampler_stack, CONFIG_APP_SAMPLER_STACK_SIZE);
+K_MSGQ_DEFINE(sampler_msgq, sizeof(struct sampler_msg), CONFIG_APP_SAMPLER_QUEUE_LEN, 4);
+K_TIMER_DEFINE(sensor_timer, sensor_timer_expiry_handler, NULL);
+
+static struct k_work_q sampler_q;
+static struct k_work sample_work;
+static struct k_work_delayable retry_work;
+static sampler_ready_cb_t ready_cb;
+static atomic_t period_ms;
+static atomic_t read_now;
+static bool forced;		// the read in progress was requested explicitly
+static uint32_t read_start;
+static struct retry_state retry;
+static struct sample_record latest;
+static uint32_t latest_uptime_s;
+static bool latest_valid;
+static struct k_spinlock latest_lock;
+static atomic_t refresh_pending;
+static atomic_t refresh_time_s;	// uptime of the last refresh request
+
+static void sensor_timer_expiry_handler(struct k_timer *timer)
+{
+	k_work_submit_to_queue(&sampler_q, &sample_work);
+}
+
+static void queue_reading(const struct sampler_msg *msg)
+{
+	struct sampler_msg dropped;
+	k_spinlock_key_t key = k_spin_lock(&latest_lock);
+
+	latest = msg->record;
+	latest_uptime_s = (uint32_t)(k_uptime_get() / MSEC_PER_SEC);
+	latest_valid = true;
+	k_spin_unlock(&latest_lock, key);
+
+	// this thread is the only producer, so a slot is free after one get
+	while(k_msgq_put(&sampler_msgq, msg, K_NO_WAIT)){
+		if(!k_msgq_get(&sampler_msgq, &dropped, K_NO_WAIT)){
+			METRIC_WRN(METRIC_READING_DROPPED, "Consumer stalled, reading at %u s dropped", dropped.record.timestamp);
+		}
+	}
+
+	if(ready_cb){
+		ready_cb();
+	}
+}
+
+static void read_cb(int err, const struct sht41_data *data)
+{
+	struct sampler_msg msg;
+	uint32_t period = (uint32_t)atomic_get(&period_ms);
+
+	wake_stats_record(WAKE_STAT_FETCH, read_start);
+	if(err){
+		METRIC_WRN(METRIC_FETCH_ERROR, "Error %d fetching sensor data", err);
+		// back off, but never wait longer than the regular interval; the timer keeps its phase
+		k_work_schedule_for_queue(&sampler_q, &retry_work, K_MSEC(MIN(retry_delay_ms(&retry, RETRY_FETCH), period)));
+	}
+	else{
+		k_work_cancel_delayable(&retry_work);
+		retry_reset(&retry, RETRY_FETCH);
+		// the reading serves any refresh requested so far
+		atomic_clear(&refresh_pending);
+		msg.forced = forced;
+		msg.record.timestamp = timesync_stamp(k_uptime_get());
+		msg.record.temp = data->temp;
+		msg.record.rh = data->rh;
+		queue_reading(&msg);
+	}
+
+	// an explicit read requested while this one was converting
+	if(atomic_get(&read_now)){
+		k_work_submit_to_queue(&sampler_q, &sample_work);
+	}
+}
+
+static void sample_work_handler(struct k_work *work)
+{
+	int res = 0;
+	bool now = atomic_clear(&read_now);
+	bool refresh = atomic_clear(&refresh_pending);
+	uint32_t start = wake_stats_start();
+
+	// an explicitly requested read always uses high precision
+	res = sht41_read_async(&sampler_q, now ? SHT41_PRECISION_HIGH : sht41_get_precision(), read_cb);
+	if(res == -EBUSY){
+		// still converting, or heating after the callback ran; read_cb() or heater_done_handler() follows up
+		if(now){
+			atomic_set(&read_now, 1);
+		}
+		if(refresh){
+			atomic_set(&refresh_pending, 1);
+		}
+		return;
+	}
+
+	if(res == -EAGAIN){
+		// the sensor is still warm from a heater pulse, periodic reads wait for the next period
+		LOG_DBG("Reading masked after heater pulse");
+		if(now || refresh){
+			// requested reads are served once the mask ends
+			if(now){
+				atomic_set(&read_now, 1);
+			}
+			if(refresh){
+				atomic_set(&refresh_pending, 1);
+			}
+			k_work_schedule_for_queue(&sampler_q, &retry_work, K_MSEC(sht41_masked_ms()));
+		}
+		return;
+	}
+
+	forced = now;
+	read_start = start;
+	if(res){
+		read_cb(res, NULL);
+	}
+}
+
+static void retry_work_handler(struct k_work *work)
+{
+	sample_work_handler(&sample_work);
+}
+
+// Serve reads refused during the pulse once the mask it leaves behind ends
+static void heater_done_handler(void)
+{
+	if(atomic_get(&read_now) || atomic_get(&refresh_pending)){
+		k_work_schedule_for_queue(&sampler_q, &retry_work, K_MSEC(sht41_masked_ms()));
+	}
+}
+
+void sampler_init(sampler_ready_cb_t ready)
+{
+	ready_cb = ready;
+	k_work_init(&sample_work, sample_work_handler);
+	k_work_init_delayable(&retry_work, retry_work_handler);
+	sht41_set_heater_done_cb(heater_done_handler);
+	k_work_queue_start(&sampler_q, sampler_stack, K_THREAD_STACK_SIZEOF(sampler_stack),
+		K_PRIO_PREEMPT(CONFIG_APP_SAMPLER_PRIORITY), NULL);
+	k_thread_name_set(&sampler_q.thread, "sampler");
+}
+
+void sampler_start(uint32_t period)
+{
+	atomic_set(&period_ms, period);
+	k_timer_start(&sensor_timer, K_NO_WAIT, K_MSEC(period));
+}
+
+void sampler_set_period(uint32_t period)
+{
+	sampler_align(period, period);
+}
+
+void sampler_align(uint32_t period, uint32_t delay)
+{
+	atomic_set(&period_ms, period);
+	k_timer_start(&sensor_timer, K_MSEC(delay), K_MSEC(period));
+}
+
+void sampler_read_now(void)
+{
+	atomic_set(&read_now, 1);
+	k_work_submit_to_queue(&sampler_q, &sample_work);
+}
+
+int sampler_get(struct sampler_msg *msg)
+{
+	return k_msgq_get(&sampler_msgq, msg, K_NO_WAIT);
+}
+
+int sampler_latest(struct sample_record *rec, uint32_t *age_s)
+{
+	int ret = -ENODATA;
+	k_spinlock_key_t key = k_spin_lock(&latest_lock);
+
+	if(latest_valid){
+		*rec = latest;
+		*age_s = (uint32_t)(k_uptime_get() / MSEC_PER_SEC) - latest_uptime_s;
+		ret = 0;
+	}
+
+	k_spin_unlock(&latest_lock, key);
+	return ret;
+}
+
+void sampler_refresh(uint32_t min_interval_s)
+{
+	uint32_t now = (uint32_t)(k_uptime_get() / MSEC_PER_SEC);
+	uint32_t last = (uint32_t)atomic_get(&refresh_time_s);
+
+	if(last && now - last < min_interval_s){
+		return;
+	}
+
+	if(atomic_set(&refresh_pending, 1)){
+		return;
+	}
+
+	atomic_set(&refresh_time_s, now ? now : 1);
+	k_work_submit_to_queue(&sampler_q, &sample_work);
+}
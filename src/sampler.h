@@ -0,0 +1,54 @@
+/* sampler.h - Sensor sampling stage */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef SAMPLER_H_
+#define SAMPLER_H_
+
+#include <stdbool.h>
+#include <zephyr/types.h>
+
+#include "sample.h"
+
+/*
+ * The sensor is read on a dedicated work queue, driven by a periodic timer,
+ * so sample timing does not depend on how busy the BLE transmit path is. The
+ * work queue only issues the measurement; the result is collected by a
+ * delayed work item once the conversion is done, leaving the CPU idle.
+ * Readings are passed to the consumer through a message queue of
+ * CONFIG_APP_SAMPLER_QUEUE_LEN entries; when the consumer falls behind the
+ * oldest reading is dropped. Failed reads are retried with backoff, never
+ * later than the regular period.
+ */
+
+struct sampler_msg{
+	struct sample_record record;
+	bool forced;	// explicitly requested read, report regardless of the deadband
+};
+
+// Called from the sampler thread whenever a reading was queued
+typedef void (*sampler_ready_cb_t)(void);
+
+void sampler_init(sampler_ready_cb_t ready);
+void sampler_start(uint32_t period_ms);
+// Change the period, the next read happens one period from now
+void sampler_set_period(uint32_t period_ms);
+// Change the period, the next read happens delay_ms from now
+void sampler_align(uint32_t period_ms, uint32_t delay_ms);
+// Read at high precision right away
+void sampler_read_now(void);
+// Take the oldest queued reading, returns 0 or -ENOMSG when empty
+int sampler_get(struct sampler_msg *msg);
+
+// Copy the most recent reading and its age, returns 0 or -ENODATA before the first one
+int sampler_latest(struct sample_record *rec, uint32_t *age_s);
+
+/*
+ * Start a regular read unless one is in progress or the last refresh was
+ * requested less than min_interval_s ago. Never blocks.
+ */
+void sampler_refresh(uint32_t min_interval_s);
+
+#endif /* SAMPLER_H_ */
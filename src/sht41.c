@@ -0,0 +1,462 @@
+/* sht41.c - SHT41 temperature and humidity sensor */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * The sensor is driven directly over I2C rather than through the sensor API
+ * because the Zephyr SHT4x driver fixes the repeatability at build time from
+ * devicetree, while the precision here is selected per measurement.
+ *
+ * In SHT41_PRECISION_AUTO routine samples use low repeatability (1.6 ms
+ * instead of 8.3 ms conversion). If the reading moved by more than
+ * CONFIG_APP_PRECISION_TEMP_THRESHOLD or CONFIG_APP_PRECISION_RH_THRESHOLD
+ * since the previous sample it is repeated at high repeatability.
+ *
+ * sht41_read_async() sends the measure command and returns. The result is
+ * read from a delayable work item once the conversion time has passed, so no
+ * thread is held while the sensor converts.
+ *
+ * With CONFIG_APP_HEATER a reading above CONFIG_APP_HEATER_RH_THRESHOLD for
+ * CONFIG_APP_HEATER_RH_COUNT samples in a row starts a heater pulse after it
+ * has been delivered. The sensor stays busy until the pulse ends and reads
+ * are refused with -EAGAIN for CONFIG_APP_HEATER_MASK_S afterwards, while the
+ * element is still warm. Pulses are never closer together than the pulse
+ * length divided by CONFIG_APP_HEATER_DUTY_PERMILLE.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/drivers/i2c.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/logging/log.h>
+#include <stdlib.h>
+
+#include "sht41.h"
+
+LOG_MODULE_REGISTER(SHT41, CONFIG_APP_SHT41_LOG_LEVEL);
+
+#define SHT41_NODE					DT_NODELABEL(sht41)
+
+#define SHT41_CMD_SOFT_RESET		0x94
+#define SHT41_CMD_READ_SERIAL		0x89
+#define SHT41_RESET_WAIT_US			1000
+#define SHT41_CMD_WAIT_US			1000
+
+#define SHT41_CRC_POLY				0x31
+#define SHT41_CRC_INIT				0xff
+
+#if defined(CONFIG_APP_HEATER)
+// Heater commands for 1 s and 0.1 s pulses, the sensor measures at high repeatability at the end
+#if defined(CONFIG_APP_HEATER_POWER_200MW)
+#define HEATER_CMD_LONG				0x39
+#define HEATER_CMD_SHORT			0x32
+#elif defined(CONFIG_APP_HEATER_POWER_110MW)
+#define HEATER_CMD_LONG				0x2f
+#define HEATER_CMD_SHORT			0x24
+#else
+#define HEATER_CMD_LONG				0x1e
+#define HEATER_CMD_SHORT			0x15
+#endif
+
+#if defined(CONFIG_APP_HEATER_PULSE_LONG)
+#define HEATER_CMD					HEATER_CMD_LONG
+#define HEATER_PULSE_MS				1000
+#else
+#define HEATER_CMD					HEATER_CMD_SHORT
+#define HEATER_PULSE_MS				100
+#endif
+
+// The datasheet allows 10 % over the pulse length for the heating and the measurement
+#define HEATER_WAIT_US				(HEATER_PULSE_MS * USEC_PER_MSEC * 11 / 10)
+#define HEATER_SPACING_MS			(HEATER_PULSE_MS * 1000 / CONFIG_APP_HEATER_DUTY_PERMILLE)
+#endif
+
+static const struct i2c_dt_spec sht41_bus = I2C_DT_SPEC_GET(SHT41_NODE);
+
+// Indexed by enum sht41_precision
+static const uint8_t measure_cmd[] = {0xe0, 0xf6, 0xfd};
+// Maximum conversion times from the datasheet
+static const uint16_t measure_wait_us[] = {1600, 4500, 8300};
+
+#if defined(CONFIG_APP_PRECISION_AUTO)
+static atomic_t precision = ATOMIC_INIT(SHT41_PRECISION_AUTO);
+#else
+static atomic_t precision = ATOMIC_INIT(DT_PROP(SHT41_NODE, repeatability));
+#endif
+
+// Previous reading, reference for escalating in SHT41_PRECISION_AUTO
+static struct sht41_data last_data;
+static bool last_valid;
+
+static void read_work_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(read_work, read_work_handler);
+static struct k_work_q *read_queue;
+static sht41_read_cb_t read_cb;
+static sht41_heater_done_cb_t heater_done_cb;
+static enum sht41_precision read_precision;
+static bool read_auto;	// low precision reading of SHT41_PRECISION_AUTO, may be repeated
+static struct sht41_data read_prev;
+static atomic_t read_busy;
+
+#if defined(CONFIG_APP_HEATER)
+static bool read_heating;		// read_work collects the end of a heater pulse
+static uint8_t heater_count;	// consecutive readings above the threshold
+static bool heater_pulsed;
+static int64_t heater_last_ms;	// uptime at the start of the last pulse
+static int64_t heater_mask_ms;	// readings are refused until this uptime
+#endif
+
+static uint8_t sht41_crc(const uint8_t *data, size_t len)
+{
+	uint8_t crc = SHT41_CRC_INIT;
+
+	for(size_t i = 0; i < len; i++){
+		crc ^= data[i];
+		for(int bit = 0; bit < 8; bit++){
+			crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ SHT41_CRC_POLY) : (uint8_t)(crc << 1);
+		}
+	}
+
+	return crc;
+}
+
+// Read back the two CRC protected words of a command
+static int sht41_read_words(uint16_t *word0, uint16_t *word1)
+{
+	int ret = 0;
+	uint8_t rx[6];
+
+	ret = i2c_read_dt(&sht41_bus, rx, sizeof(rx));
+	if(ret){
+		return ret;
+	}
+
+	if(sht41_crc(&rx[0], 2) != rx[2] || sht41_crc(&rx[3], 2) != rx[5]){
+		LOG_ERR("CRC error");
+		return -EIO;
+	}
+
+	*word0 = sys_get_be16(&rx[0]);
+	*word1 = sys_get_be16(&rx[3]);
+
+	return 0;
+}
+
+// Send a command and read back two CRC protected words
+static int sht41_transfer(uint8_t cmd, uint32_t wait_us, uint16_t *word0, uint16_t *word1)
+{
+	int ret = 0;
+
+	ret = i2c_write_dt(&sht41_bus, &cmd, sizeof(cmd));
+	if(ret){
+		return ret;
+	}
+
+	k_sleep(K_USEC(wait_us));
+
+	return sht41_read_words(word0, word1);
+}
+
+static void sht41_convert(uint16_t t_ticks, uint16_t rh_ticks, struct sht41_data *data)
+{
+	int32_t rh;
+
+	// T = -45 + 175 * ticks / 65535, RH = -6 + 125 * ticks / 65535, in hundredths
+	data->temp = (int16_t)(-4500 + (int32_t)((17500 * (uint32_t)t_ticks) / 65535));
+	rh = -600 + (int32_t)((12500 * (uint32_t)rh_ticks) / 65535);
+	data->rh = (uint16_t)CLAMP(rh, 0, 10000);
+
+	last_data = *data;
+	last_valid = true;
+}
+
+static bool sht41_moved(const struct sht41_data *data, const struct sht41_data *prev)
+{
+	return abs(data->temp - prev->temp) > CONFIG_APP_PRECISION_TEMP_THRESHOLD ||
+		abs(data->rh - prev->rh) > CONFIG_APP_PRECISION_RH_THRESHOLD;
+}
+
+int sht41_init(void)
+{
+	int ret = 0;
+	uint8_t cmd = SHT41_CMD_SOFT_RESET;
+	uint16_t serial_hi;
+	uint16_t serial_lo;
+
+	if(!device_is_ready(sht41_bus.bus)){
+		LOG_ERR("%s device not ready", sht41_bus.bus->name);
+		return -ENODEV;
+	}
+
+	ret = i2c_write_dt(&sht41_bus, &cmd, sizeof(cmd));
+	if(ret){
+		LOG_ERR("Sensor not responding");
+		return -ENODEV;
+	}
+
+	k_sleep(K_USEC(SHT41_RESET_WAIT_US));
+
+	ret = sht41_transfer(SHT41_CMD_READ_SERIAL, SHT41_CMD_WAIT_US, &serial_hi, &serial_lo);
+	if(ret){
+		LOG_ERR("Read serial number error %d", ret);
+		return ret;
+	}
+
+	LOG_INF("SHT41 serial %04x%04x", serial_hi, serial_lo);
+
+	return 0;
+}
+
+void sht41_set_precision(enum sht41_precision value)
+{
+	atomic_set(&precision, CLAMP(value, SHT41_PRECISION_LOW, SHT41_PRECISION_AUTO));
+}
+
+enum sht41_precision sht41_get_precision(void)
+{
+	return (enum sht41_precision)atomic_get(&precision);
+}
+
+int sht41_fetch_data_at(struct sht41_data *data, enum sht41_precision p)
+{
+	int ret = 0;
+	uint16_t t_ticks;
+	uint16_t rh_ticks;
+
+	ret = sht41_transfer(measure_cmd[p], measure_wait_us[p], &t_ticks, &rh_ticks);
+	if(ret){
+		LOG_DBG("Sample fetch error");
+		return ret;
+	}
+
+	sht41_convert(t_ticks, rh_ticks, data);
+
+	return 0;
+}
+
+int sht41_fetch_data(struct sht41_data *data)
+{
+	int ret = 0;
+	enum sht41_precision p = sht41_get_precision();
+	struct sht41_data prev = last_data;
+
+	if(p != SHT41_PRECISION_AUTO){
+		return sht41_fetch_data_at(data, p);
+	}
+
+	if(!last_valid){
+		// no reference yet
+		return sht41_fetch_data_at(data, SHT41_PRECISION_HIGH);
+	}
+
+	ret = sht41_fetch_data_at(data, SHT41_PRECISION_LOW);
+	if(ret){
+		return ret;
+	}
+
+	if(sht41_moved(data, &prev)){
+		LOG_DBG("Reading changed, repeating at high precision");
+		return sht41_fetch_data_at(data, SHT41_PRECISION_HIGH);
+	}
+
+	return 0;
+}
+
+#if defined(CONFIG_APP_HEATER)
+// Start a heater pulse after a reading if it is due, returns true when started
+static bool heater_start(const struct sht41_data *data)
+{
+	int ret = 0;
+	uint8_t cmd = HEATER_CMD;
+	int64_t now = k_uptime_get();
+
+	if(data->rh < CONFIG_APP_HEATER_RH_THRESHOLD){
+		heater_count = 0;
+		return false;
+	}
+
+	if(heater_count < CONFIG_APP_HEATER_RH_COUNT){
+		heater_count++;
+	}
+
+	if(heater_count < CONFIG_APP_HEATER_RH_COUNT){
+		return false;
+	}
+
+	if(heater_pulsed && now - heater_last_ms < HEATER_SPACING_MS){
+		LOG_DBG("Heater pulse held back by the duty cycle limit");
+		return false;
+	}
+
+	ret = i2c_write_dt(&sht41_bus, &cmd, sizeof(cmd));
+	if(ret){
+		LOG_WRN("Heater start error %d", ret);
+		return false;
+	}
+
+	LOG_INF("Heater pulse at %u.%02u %%RH", data->rh / 100, data->rh % 100);
+	heater_count = 0;
+	heater_pulsed = true;
+	heater_last_ms = now;
+	read_heating = true;
+	k_work_schedule_for_queue(read_queue, &read_work, K_USEC(HEATER_WAIT_US));
+
+	return true;
+}
+
+static void heater_done(void)
+{
+	uint16_t t_ticks;
+	uint16_t rh_ticks;
+
+	// the measurement taken while hot is only read to finish the command
+	if(sht41_read_words(&t_ticks, &rh_ticks)){
+		LOG_DBG("Heater read error");
+	}
+
+	read_heating = false;
+	heater_mask_ms = k_uptime_get() + CONFIG_APP_HEATER_MASK_S * MSEC_PER_SEC;
+	atomic_clear(&read_busy);
+
+	if(heater_done_cb){
+		heater_done_cb();
+	}
+}
+
+static bool heater_masked(void)
+{
+	return heater_pulsed && k_uptime_get() < heater_mask_ms;
+}
+
+static uint32_t heater_mask_left_ms(void)
+{
+	return heater_masked() ? (uint32_t)(heater_mask_ms - k_uptime_get()) : 0;
+}
+#else
+static inline bool heater_start(const struct sht41_data *data)
+{
+	return false;
+}
+
+static inline bool heater_masked(void)
+{
+	return false;
+}
+
+static inline uint32_t heater_mask_left_ms(void)
+{
+	return 0;
+}
+#endif
+
+static int read_start(enum sht41_precision p)
+{
+	int ret = 0;
+	uint8_t cmd = measure_cmd[p];
+
+	ret = i2c_write_dt(&sht41_bus, &cmd, sizeof(cmd));
+	if(ret){
+		return ret;
+	}
+
+	read_precision = p;
+	k_work_schedule_for_queue(read_queue, &read_work, K_USEC(measure_wait_us[p]));
+	return 0;
+}
+
+static void read_done(int err, const struct sht41_data *data)
+{
+	sht41_read_cb_t cb = read_cb;
+
+	atomic_clear(&read_busy);
+	cb(err, data);
+}
+
+static void read_work_handler(struct k_work *work)
+{
+	int ret = 0;
+	uint16_t t_ticks;
+	uint16_t rh_ticks;
+	struct sht41_data data;
+	sht41_read_cb_t cb = read_cb;
+
+#if defined(CONFIG_APP_HEATER)
+	if(read_heating){
+		heater_done();
+		return;
+	}
+#endif
+
+	ret = sht41_read_words(&t_ticks, &rh_ticks);
+	if(ret){
+		LOG_DBG("Sample fetch error");
+		read_done(ret, NULL);
+		return;
+	}
+
+	sht41_convert(t_ticks, rh_ticks, &data);
+
+	if(read_auto && sht41_moved(&data, &read_prev)){
+		LOG_DBG("Reading changed, repeating at high precision");
+		read_auto = false;
+		ret = read_start(SHT41_PRECISION_HIGH);
+		if(ret){
+			read_done(ret, NULL);
+		}
+		return;
+	}
+
+	// a heater pulse keeps the sensor busy until heater_done()
+	if(!heater_start(&data)){
+		atomic_clear(&read_busy);
+	}
+
+	cb(0, &data);
+}
+
+int sht41_read_async(struct k_work_q *queue, enum sht41_precision p, sht41_read_cb_t cb)
+{
+	int ret = 0;
+
+	if(atomic_set(&read_busy, 1)){
+		return -EBUSY;
+	}
+
+	if(heater_masked()){
+		atomic_clear(&read_busy);
+		return -EAGAIN;
+	}
+
+	read_queue = queue;
+	read_cb = cb;
+	read_auto = false;
+	if(p == SHT41_PRECISION_AUTO){
+		// without a reference go straight to high precision
+		read_auto = last_valid;
+		read_prev = last_data;
+		p = last_valid ? SHT41_PRECISION_LOW : SHT41_PRECISION_HIGH;
+	}
+
+	ret = read_start(p);
+	if(ret){
+		atomic_clear(&read_busy);
+	}
+
+	return ret;
+}
+
+uint32_t sht41_masked_ms(void)
+{
+	return heater_mask_left_ms();
+}
+
+void sht41_set_heater_done_cb(sht41_heater_done_cb_t cb)
+{
+	heater_done_cb = cb;
+}
@@ -0,0 +1,57 @@
+/* sht41.h - SHT41 temperature and humidity sensor */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef SHT41_H_
+#define SHT41_H_
+
+#include <zephyr/kernel.h>
+#include <zephyr/types.h>
+
+// Measurement repeatability, values match the devicetree repeatability property
+enum sht41_precision{
+	SHT41_PRECISION_LOW = 0,
+	SHT41_PRECISION_MEDIUM = 1,
+	SHT41_PRECISION_HIGH = 2,
+	// low repeatability, repeated at high when the reading moved past a threshold
+	SHT41_PRECISION_AUTO = 3
+};
+
+struct sht41_data{
+	int16_t temp;	// centi-degrees Celsius
+	uint16_t rh;	// centi-percent
+};
+
+// Completion of sht41_read_async(), data is NULL on error
+typedef void (*sht41_read_cb_t)(int err, const struct sht41_data *data);
+// End of a heater pulse, run on the sht41_read_async() work queue
+typedef void (*sht41_heater_done_cb_t)(void);
+
+int sht41_init(void);
+
+void sht41_set_precision(enum sht41_precision precision);
+enum sht41_precision sht41_get_precision(void);
+
+// Run a measurement at the current precision
+int sht41_fetch_data(struct sht41_data *data);
+
+// Run one measurement at the given precision, ignoring the current setting
+int sht41_fetch_data_at(struct sht41_data *data, enum sht41_precision precision);
+
+/*
+ * Start a measurement and return without waiting for the conversion. The
+ * result is read on the given work queue and passed to cb there. Returns
+ * -EBUSY while a previous read or a heater pulse is still in progress and
+ * -EAGAIN while readings are masked after a heater pulse.
+ */
+int sht41_read_async(struct k_work_q *queue, enum sht41_precision precision, sht41_read_cb_t cb);
+
+// Milliseconds until readings are accepted again after a heater pulse, 0 when not masked
+uint32_t sht41_masked_ms(void);
+
+// Reads refused with -EBUSY during a pulse can be restarted from cb
+void sht41_set_heater_done_cb(sht41_heater_done_cb_t cb);
+
+#endif /* SHT41_H_ */
@@ -0,0 +1,205 @@
+/* sht41_emul.c - SHT41 emulator for simulated boards */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Answers the commands sht41.c sends on an emulated I2C bus, so the
+ * application runs unchanged on boards without the sensor, e.g. nrf52_bsim.
+ * The temperature and humidity follow a triangle wave around
+ * CONFIG_APP_SHT41_EMUL_TEMP and CONFIG_APP_SHT41_EMUL_RH with a period of
+ * CONFIG_APP_SHT41_EMUL_PERIOD_S. Lower repeatability adds noise, heater
+ * commands return a hot and dry reading.
+ */
+
+#define DT_DRV_COMPAT sensirion_sht4x
+
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/emul.h>
+#include <zephyr/drivers/i2c.h>
+#include <zephyr/drivers/i2c_emul.h>
+#include <zephyr/random/rand32.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(SHT41_EMUL, CONFIG_APP_SHT41_LOG_LEVEL);
+
+#define SHT41_CMD_SOFT_RESET		0x94
+#define SHT41_CMD_READ_SERIAL		0x89
+#define SHT41_CMD_MEASURE_HIGH		0xfd
+#define SHT41_CMD_MEASURE_MEDIUM	0xf6
+#define SHT41_CMD_MEASURE_LOW		0xe0
+
+// Noise amplitude by repeatability (centi-units)
+#define NOISE_HIGH					0
+#define NOISE_MEDIUM				5
+#define NOISE_LOW					15
+
+// Heater commands measure at the end of the pulse
+#define HEATER_TEMP_RISE			2000
+#define HEATER_RH_DIVISOR			2
+
+struct sht41_emul_data{
+	uint8_t cmd;		// command whose result is read next
+	bool pending;
+};
+
+struct sht41_emul_cfg{
+	uint16_t addr;
+};
+
+static uint8_t emul_crc(const uint8_t *data, size_t len)
+{
+	uint8_t crc = 0xff;
+
+	for(size_t i = 0; i < len; i++){
+		crc ^= data[i];
+		for(int bit = 0; bit < 8; bit++){
+			crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x31) : (uint8_t)(crc << 1);
+		}
+	}
+
+	return crc;
+}
+
+static void put_word(uint8_t *buf, uint16_t word)
+{
+	sys_put_be16(word, buf);
+	buf[2] = emul_crc(buf, 2);
+}
+
+// Offset of the triangle wave at the current time, from -swing/2 to swing/2
+static int32_t wave(void)
+{
+	uint32_t period = CONFIG_APP_SHT41_EMUL_PERIOD_S;
+	uint32_t phase = (uint32_t)(k_uptime_get() / MSEC_PER_SEC) % period;
+	uint32_t rise = (phase < period / 2) ? phase : period - phase;
+
+	return (int32_t)(rise * CONFIG_APP_SHT41_EMUL_SWING / (period / 2)) - CONFIG_APP_SHT41_EMUL_SWING / 2;
+}
+
+static int32_t noise(int32_t amplitude)
+{
+	if(!amplitude){
+		return 0;
+	}
+
+	return (int32_t)(sys_rand32_get() % (2 * amplitude + 1)) - amplitude;
+}
+
+static void measure(uint8_t cmd, uint8_t *buf)
+{
+	int32_t amplitude = NOISE_HIGH;
+	int32_t temp = CONFIG_APP_SHT41_EMUL_TEMP + wave();
+	int32_t rh = CONFIG_APP_SHT41_EMUL_RH + wave();
+
+	switch(cmd){
+	case SHT41_CMD_MEASURE_HIGH:
+		break;
+
+	case SHT41_CMD_MEASURE_MEDIUM:
+		amplitude = NOISE_MEDIUM;
+		break;
+
+	case SHT41_CMD_MEASURE_LOW:
+		amplitude = NOISE_LOW;
+		break;
+
+	default:
+		// heater pulse
+		temp += HEATER_TEMP_RISE;
+		rh /= HEATER_RH_DIVISOR;
+		break;
+	}
+
+	temp = CLAMP(temp + noise(amplitude), -4500, 12999);
+	rh = CLAMP(rh + noise(amplitude), 0, 10000);
+
+	// inverse of the conversion in sht41.c
+	put_word(&buf[0], (uint16_t)((temp + 4500) * 65535 / 17500));
+	put_word(&buf[3], (uint16_t)((rh + 600) * 65535 / 12500));
+}
+
+static bool is_read_command(uint8_t cmd)
+{
+	switch(cmd){
+	case SHT41_CMD_READ_SERIAL:
+	case SHT41_CMD_MEASURE_HIGH:
+	case SHT41_CMD_MEASURE_MEDIUM:
+	case SHT41_CMD_MEASURE_LOW:
+	// heater, 200, 110 and 20 mW for 1 s and 0.1 s
+	case 0x39:
+	case 0x32:
+	case 0x2f:
+	case 0x24:
+	case 0x1e:
+	case 0x15:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static int sht41_emul_transfer(const struct emul *target, struct i2c_msg *msgs, int num_msgs, int addr)
+{
+	struct sht41_emul_data *data = target->data;
+	const struct sht41_emul_cfg *cfg = target->cfg;
+
+	for(int i = 0; i < num_msgs; i++){
+		if(!(msgs[i].flags & I2C_MSG_READ)){
+			if(msgs[i].len != 1){
+				return -EIO;
+			}
+
+			data->cmd = msgs[i].buf[0];
+			data->pending = is_read_command(data->cmd);
+			if(!data->pending && data->cmd != SHT41_CMD_SOFT_RESET){
+				LOG_WRN("Unknown command 0x%02x", data->cmd);
+				return -EIO;
+			}
+			continue;
+		}
+
+		// the real sensor NACKs a read without a result
+		if(!data->pending || msgs[i].len != 6){
+			return -EIO;
+		}
+
+		if(data->cmd == SHT41_CMD_READ_SERIAL){
+			put_word(&msgs[i].buf[0], 0x5eed);
+			put_word(&msgs[i].buf[3], cfg->addr);
+		}
+		else{
+			measure(data->cmd, msgs[i].buf);
+		}
+
+		data->pending = false;
+	}
+
+	return 0;
+}
+
+static const struct i2c_emul_api sht41_emul_api = {
+	.transfer = sht41_emul_transfer,
+};
+
+static int sht41_emul_init(const struct emul *target, const struct device *parent)
+{
+	struct sht41_emul_data *data = target->data;
+
+	data->pending = false;
+	return 0;
+}
+
+#define SHT41_EMUL(n)															\
+	static struct sht41_emul_data sht41_emul_data_##n;							\
+	static const struct sht41_emul_cfg sht41_emul_cfg_##n = {					\
+		.addr = DT_INST_REG_ADDR(n),											\
+	};																			\
+	EMUL_DT_INST_DEFINE(n, sht41_emul_init, &sht41_emul_data_##n, &sht41_emul_cfg_##n,	\
+		&sht41_emul_api, NULL)
+
+DT_INST_FOREACH_STATUS_OKAY(SHT41_EMUL)
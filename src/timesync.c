@@ -0,0 +1,111 @@
+/* timesync.c - Gateway time synchronization */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/logging/log.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "timesync.h"
+
+LOG_MODULE_REGISTER(TIMESYNC, CONFIG_APP_TIMESYNC_LOG_LEVEL);
+
+// Drift beyond this is a clock jump on the gateway rather than crystal error
+#define DRIFT_MAX_PPB				(1000 * 1000)
+
+static struct k_spinlock lock;
+static bool synced;
+static int64_t sync_uptime_ms;		// latest sync, sets the offset
+static int64_t sync_unix_ms;
+static int64_t ref_uptime_ms;		// drift measurement reference
+static int64_t ref_unix_ms;
+static int32_t drift_ppb;
+static bool drift_valid;
+
+int timesync_set(uint64_t unix_ms)
+{
+	int64_t now = k_uptime_get();
+	int64_t local;
+	int64_t diff;
+	int64_t ppb;
+	k_spinlock_key_t key;
+
+	// stamps are uint32 seconds, this also keeps unix_ms far below INT64_MAX
+	if(unix_ms / MSEC_PER_SEC < TIMESYNC_EPOCH_MIN || unix_ms / MSEC_PER_SEC > TIMESYNC_EPOCH_MAX){
+		return -EINVAL;
+	}
+
+	key = k_spin_lock(&lock);
+
+	if(!synced){
+		ref_uptime_ms = now;
+		ref_unix_ms = (int64_t)unix_ms;
+	}
+
+	local = now - ref_uptime_ms;
+	if(local >= (int64_t)CONFIG_APP_TIMESYNC_DRIFT_INTERVAL_S * MSEC_PER_SEC){
+		diff = (int64_t)unix_ms - ref_unix_ms - local;
+		// bound the raw difference first, scaling a jump to ppb overflows
+		if(llabs(diff) <= local * DRIFT_MAX_PPB / 1000000000){
+			ppb = diff * 1000000000 / local;
+			// smooth out the latency jitter of single syncs
+			drift_ppb = drift_valid ? (int32_t)(drift_ppb + (ppb - drift_ppb) / 4) : (int32_t)ppb;
+			drift_valid = true;
+		}
+		else{
+			LOG_WRN("Time jumped, drift estimate restarted");
+			drift_ppb = 0;
+			drift_valid = false;
+		}
+		ref_uptime_ms = now;
+		ref_unix_ms = (int64_t)unix_ms;
+	}
+
+	sync_uptime_ms = now;
+	sync_unix_ms = (int64_t)unix_ms;
+	synced = true;
+
+	k_spin_unlock(&lock, key);
+	LOG_INF("Time synced, drift %d ppb", drift_ppb);
+	return 0;
+}
+
+bool timesync_synced(void)
+{
+	return synced;
+}
+
+int32_t timesync_drift_ppb(void)
+{
+	return drift_ppb;
+}
+
+int64_t timesync_unix_ms(int64_t uptime_ms)
+{
+	int64_t elapsed;
+	int64_t unix_ms = -1;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if(synced){
+		elapsed = uptime_ms - sync_uptime_ms;
+		unix_ms = sync_unix_ms + elapsed + elapsed * drift_ppb / 1000000000;
+	}
+
+	k_spin_unlock(&lock, key);
+	return unix_ms;
+}
+
+uint32_t timesync_stamp(int64_t uptime_ms)
+{
+	int64_t unix_ms = timesync_unix_ms(uptime_ms);
+
+	if(unix_ms < 0){
+		return (uint32_t)(uptime_ms / MSEC_PER_SEC);
+	}
+
+	return (uint32_t)(unix_ms / MSEC_PER_SEC);
+}
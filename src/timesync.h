@@ -0,0 +1,39 @@
+/* timesync.h - Gateway time synchronization */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef TIMESYNC_H_
+#define TIMESYNC_H_
+
+#include <stdbool.h>
+#include <zephyr/types.h>
+
+/*
+ * A gateway writes its Unix time in milliseconds. The latest write sets the
+ * offset between uptime and Unix time; writes at least
+ * CONFIG_APP_TIMESYNC_DRIFT_INTERVAL_S apart also measure how fast the local
+ * clock runs against the gateway, and that drift is corrected for between
+ * syncs. Nothing is kept across resets.
+ */
+
+// Sample timestamps from here up are Unix time, below are seconds since boot
+#define TIMESYNC_EPOCH_MIN			0x40000000
+// Last Unix second a uint32 timestamp holds
+#define TIMESYNC_EPOCH_MAX			UINT32_MAX
+
+// Returns -EINVAL for times outside TIMESYNC_EPOCH_MIN to TIMESYNC_EPOCH_MAX
+int timesync_set(uint64_t unix_ms);
+bool timesync_synced(void);
+
+// Estimated local clock error in parts per billion, positive when it runs slow
+int32_t timesync_drift_ppb(void);
+
+// Unix time in milliseconds at uptime_ms, or -1 before the first sync
+int64_t timesync_unix_ms(int64_t uptime_ms);
+
+// Timestamp for a sample taken at uptime_ms: Unix seconds once synced, else uptime seconds
+uint32_t timesync_stamp(int64_t uptime_ms);
+
+#endif /* TIMESYNC_H_ */
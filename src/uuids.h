@@ -0,0 +1,21 @@
+/* uuids.h - GATT service and characteristic UUIDs */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef UUIDS_H_
+#define UUIDS_H_
+
+#include <zephyr/bluetooth/uuid.h>
+
+#define MAIN_SERVICE_UUID	BT_UUID_128_ENCODE(0xedd1a5f3, 0xdbb0, 0x4b29, 0xb449, 0xa4be5161f18e)
+#define RX_UUID				BT_UUID_128_ENCODE(0xedd1a5f3, 0xdbb2, 0x4b29, 0xb449, 0xa4be5161f18e)
+#define TX_UUID				BT_UUID_128_ENCODE(0xedd1a5f3, 0xdbb3, 0x4b29, 0xb449, 0xa4be5161f18e)
+#define LOG_UUID			BT_UUID_128_ENCODE(0xedd1a5f3, 0xdbb4, 0x4b29, 0xb449, 0xa4be5161f18e)
+#define METRICS_UUID		BT_UUID_128_ENCODE(0xedd1a5f3, 0xdbb5, 0x4b29, 0xb449, 0xa4be5161f18e)
+
+#define DIAG_SERVICE_UUID	BT_UUID_128_ENCODE(0xedd1a5f3, 0xdbc0, 0x4b29, 0xb449, 0xa4be5161f18e)
+#define WAKE_STATS_UUID		BT_UUID_128_ENCODE(0xedd1a5f3, 0xdbc1, 0x4b29, 0xb449, 0xa4be5161f18e)
+
+#endif /* UUIDS_H_ */
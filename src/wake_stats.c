@@ -0,0 +1,126 @@
+/* wake_stats.c - Wake-up and duration instrumentation */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/gatt.h>
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+#include <string.h>
+
+#include "uuids.h"
+#include "wake_stats.h"
+
+// Encoded size of one stat
+#define WAKE_STAT_SIZE				(2 * sizeof(uint32_t) + sizeof(uint64_t) + WAKE_STATS_BUCKETS * sizeof(uint16_t))
+
+struct wake_stat_data{
+	uint32_t count;
+	uint32_t max_us;
+	uint64_t total_us;
+	uint16_t buckets[WAKE_STATS_BUCKETS];
+};
+
+static struct wake_stat_data stats[WAKE_STAT_COUNT];
+static struct k_spinlock lock;
+
+static ssize_t wake_stats_read(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset);
+static ssize_t wake_stats_written(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf, uint16_t len, uint16_t offset, uint8_t flags);
+
+BT_GATT_SERVICE_DEFINE(diag_service,
+	BT_GATT_PRIMARY_SERVICE(BT_UUID_DECLARE_128(DIAG_SERVICE_UUID)),
+	BT_GATT_CHARACTERISTIC(BT_UUID_DECLARE_128(WAKE_STATS_UUID), BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
+		BT_GATT_PERM_READ | BT_GATT_PERM_WRITE, wake_stats_read, wake_stats_written, NULL),
+);
+
+void wake_stats_record(enum wake_stat stat, uint32_t start)
+{
+	uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+	struct wake_stat_data *data = &stats[stat];
+	size_t bucket = MIN((us < 2) ? 0 : (size_t)(31 - __builtin_clz(us)), WAKE_STATS_BUCKETS - 1);
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	data->count++;
+	data->max_us = MAX(data->max_us, us);
+	data->total_us += us;
+	if(data->buckets[bucket] < UINT16_MAX){
+		data->buckets[bucket]++;
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+static ssize_t wake_stats_read(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset)
+{
+	// only read from the BT RX thread, kept off its stack
+	static uint8_t value[WAKE_STAT_COUNT * WAKE_STAT_SIZE];
+	uint8_t *pos = value;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	for(size_t i = 0; i < WAKE_STAT_COUNT; i++){
+		sys_put_le32(stats[i].count, pos);
+		sys_put_le32(stats[i].max_us, pos + 4);
+		sys_put_le64(stats[i].total_us, pos + 8);
+		pos += 16;
+		for(size_t j = 0; j < WAKE_STATS_BUCKETS; j++){
+			sys_put_le16(stats[i].buckets[j], pos);
+			pos += sizeof(uint16_t);
+		}
+	}
+
+	k_spin_unlock(&lock, key);
+
+	return bt_gatt_attr_read(conn, attr, buf, len, offset, value, sizeof(value));
+}
+
+static ssize_t wake_stats_written(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf, uint16_t len, uint16_t offset, uint8_t flags)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	memset(stats, 0, sizeof(stats));
+	k_spin_unlock(&lock, key);
+
+	return len;
+}
+
+#if defined(CONFIG_SHELL)
+static const char *const stat_names[] = {
+	[WAKE_STAT_WAKE_SAMPLE] = "wake sample",
+	[WAKE_STAT_WAKE_BLE_RX] = "wake ble rx",
+	[WAKE_STAT_WAKE_RETRY] = "wake retry",
+	[WAKE_STAT_FETCH] = "fetch",
+	[WAKE_STAT_NOTIFY] = "notify",
+	[WAKE_STAT_ACK_WAIT] = "ack wait"
+};
+
+static int cmd_wake_stats(const struct shell *sh, size_t argc, char **argv)
+{
+	struct wake_stat_data data;
+	k_spinlock_key_t key;
+
+	for(size_t i = 0; i < WAKE_STAT_COUNT; i++){
+		key = k_spin_lock(&lock);
+		data = stats[i];
+		k_spin_unlock(&lock, key);
+
+		shell_print(sh, "%-12s count %u max %u us mean %u us", stat_names[i], data.count, data.max_us,
+			data.count ? (uint32_t)(data.total_us / data.count) : 0);
+		for(size_t j = 0; j < WAKE_STATS_BUCKETS; j++){
+			if(data.buckets[j]){
+				shell_print(sh, "  >= %u us: %u", (j ? BIT(j) : 0), data.buckets[j]);
+			}
+		}
+	}
+
+	return 0;
+}
+
+SHELL_CMD_REGISTER(wake_stats, NULL, "Print wake-up and duration stats", cmd_wake_stats);
+#endif
@@ -0,0 +1,56 @@
+/* wake_stats.h - Wake-up and duration instrumentation */
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef WAKE_STATS_H_
+#define WAKE_STATS_H_
+
+#include <zephyr/kernel.h>
+#include <zephyr/types.h>
+
+/*
+ * Durations measured with the cycle counter are collected per stat as count,
+ * total, maximum and a histogram of power of two microsecond buckets. The
+ * WAKE_STAT_WAKE_* stats are the CPU active time of one main loop pass by the
+ * cause of the wake-up, the others time single operations.
+ *
+ * The stats are read from the wake stats characteristic of the diagnostic
+ * service, every stat encoded little endian as uint32 count, uint32 maximum
+ * (us), uint64 total (us) and WAKE_STATS_BUCKETS uint16 bucket counts.
+ * Bucket 0 counts durations below 2 us, bucket n those from 2^n us, the last
+ * one everything longer. Writing the characteristic resets them. With
+ * CONFIG_SHELL they are also printed by the "wake_stats" command.
+ */
+
+#define WAKE_STATS_BUCKETS			24
+
+enum wake_stat{
+	WAKE_STAT_WAKE_SAMPLE,		// reading from the sampler
+	WAKE_STAT_WAKE_BLE_RX,		// client write or connection event
+	WAKE_STAT_WAKE_RETRY,		// ack timeout or retry deadline
+	WAKE_STAT_FETCH,			// sensor read, from start to result
+	WAKE_STAT_NOTIFY,			// bt_gatt_notify() call
+	WAKE_STAT_ACK_WAIT,			// notification sent until acknowledged
+	WAKE_STAT_COUNT
+};
+
+#if defined(CONFIG_APP_WAKE_STATS)
+
+static inline uint32_t wake_stats_start(void)
+{
+	return k_cycle_get_32();
+}
+
+// Record the time since start, a value from wake_stats_start()
+void wake_stats_record(enum wake_stat stat, uint32_t start);
+
+#else
+
+static inline uint32_t wake_stats_start(void) { return 0; }
+static inline void wake_stats_record(enum wake_stat stat, uint32_t start) {}
+
+#endif
+
+#endif /* WAKE_STATS_H_ */